@@ -0,0 +1,48 @@
+#!/bin/bash -e
+
+# Copyright 2016 The Fuchsia Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Netboot a file to out/nbdevice at each loss rate, printing its
+# throughput.  Needs root (or CAP_NET_ADMIN) for the tap interface.
+# IMPAIR adds to every run (IMPAIR=delay=1ms,rate=1gbit, say),
+# NBSERVER passes options to nbserver (NBSERVER="-f 32/2", say) and
+# SEED picks the frames lost, so the same arguments give the same curve.
+
+if [ -z "$1" ]; then
+	echo usage: $0 "<file> [ <loss%> ]*"
+	exit 1
+fi
+
+FILE="$1"
+shift
+LOSSES="${@:-0 0.1 0.5 1 2 5}"
+SEED="${SEED:-1}"
+TIMEOUT="${TIMEOUT:-300}"
+
+echo "# loss% seconds MB/s (file $FILE seed $SEED${IMPAIR:+ impair $IMPAIR}${NBSERVER:+ nbserver $NBSERVER})"
+for loss in $LOSSES; do
+	spec="loss=$loss${IMPAIR:+,$IMPAIR}"
+	out/nbdevice -s $SEED -T $TIMEOUT -i "$spec" kernel.bin="$FILE" \
+		> out/losscurve.log 2>&1 &
+	dev=$!
+	# give the tap a moment to come up before listening for it
+	sleep 0.5
+	timeout $TIMEOUT out/nbserver -1 $NBSERVER "$FILE" > /dev/null 2>&1 || true
+	if wait $dev; then
+		grep ^boot out/losscurve.log | awk -v loss=$loss '{ print loss, $3, $4 }'
+	else
+		echo $loss - -
+	fi
+done
@@ -15,20 +15,39 @@
 # limitations under the License.
 
 if [ -z "$1" ]; then
-	echo usage: $0 "<diskimg>"
+	echo usage: $0 "<diskimg> [ <bootpart-img> ]"
 	exit 1
 fi
 
+# must match BOOTPART_TYPE_GUID_STR in src/bootpart.h
+BOOTPART_TYPE=55bfcddd-e8e6-4e14-a21a-fca97558a79a
+
 if [[ ! -f $1 ]]; then
 	echo creating: $1
-	dd if=/dev/zero of="$1" bs=512 count=93750
+	dd if=/dev/zero of="$1" bs=512 count=0 seek=356386
 
 	parted "$1" -s -a minimal mklabel gpt
 	parted "$1" -s -a minimal mkpart EFI FAT16 2048s 93716s
 	parted "$1" -s -a minimal toggle 1 boot
+	parted "$1" -s -a minimal mkpart bootpart 94208s 356351s
+	sgdisk -t 2:$BOOTPART_TYPE "$1" > /dev/null
 
 	mformat -i "$1"@@1024K -h 32 -t 32 -n 64 -c 1
     mmd -i "$1"@@1024K ::EFI
     mmd -i "$1"@@1024K ::EFI/BOOT
 fi
 
+if [[ -n "$2" ]]; then
+	start=$(sgdisk -i 2 "$1" | awk '/^First sector:/ { print $3 }')
+	end=$(sgdisk -i 2 "$1" | awk '/^Last sector:/ { print $3 }')
+	if [[ -z "$start" ]]; then
+		echo "$1 has no boot image partition; remove it to regenerate"
+		exit 1
+	fi
+	if (( $(stat -c %s "$2") > (end - start + 1) * 512 )); then
+		echo "$2 does not fit in the boot image partition"
+		exit 1
+	fi
+	echo writing: $2 to $1 at sector $start
+	dd if="$2" of="$1" bs=512 seek=$start conv=notrunc,sparse status=none
+fi
@@ -0,0 +1,26 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <efi.h>
+
+// Text console drawn directly into the GOP framebuffer with a
+// built-in font, avoiding the firmware's per-character ConOut
+// rendering.  Returns 0 on success.  The screen is cleared.
+int fbcon_init(EFI_GRAPHICS_OUTPUT_PROTOCOL* gop);
+
+// Write len characters to the console.  Usable as a console
+// output for AddConsoleOutput(), and after ExitBootServices().
+void fbcon_write(const char* str, size_t len);
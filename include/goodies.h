@@ -14,19 +14,107 @@
 
 #pragma once
 
+#include <sha256.h>
+
 void InitGoodies(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys);
 
 void WaitAnyKey(void);
 void Fatal(const char* msg, EFI_STATUS status);
 CHAR16* HandleToString(EFI_HANDLE handle);
 
+// Send printf() output to write() rather than the firmware
+// ConOut.  Several outputs may be added; each gets all output.
+// flush(), which may be NULL, writes out anything buffered.
+int AddConsoleOutput(void (*write)(const char* str, size_t len), void (*flush)(void));
+
+// Flush the log and any buffered console output, at idle points
+// or before waiting for input, for example.
+void ConsoleFlush(void);
+
+// Boot log: once LogInit() allocates it (below 4GB), printf()
+// output is also kept in this ring, which is handed to the kernel.
+// data[written % size] is where the next byte goes; if written
+// exceeds size, the oldest output has been overwritten.
+#define BOOTLOG_MAGIC 0x474f4c42 // "BLOG"
+
+typedef struct {
+    UINT32 magic;
+    UINT32 size; // of data[]
+    UINT64 written; // total bytes ever logged
+    char data[];
+} bootlog;
+
+int LogInit(size_t size);
+bootlog* LogBuffer(void);
+
+// In quiet mode printf() output only goes to the log, and reaches
+// the console when LogFlush() (or ConsoleFlush()) is called, or the
+// ring fills.
+void LogSetQuiet(int quiet);
+void LogFlush(void);
+
+// Copy up to len bytes of the log from *offset, returning how
+// many were copied.  *offset is moved past anything overwritten.
+size_t LogRead(uint64_t* offset, void* data, size_t len);
+
 // Convenience wrappers for Open/Close protocol for use by
 // UEFI app code that's not a driver model participant
 EFI_STATUS OpenProtocol(EFI_HANDLE h, EFI_GUID* guid, void** ifc);
 EFI_STATUS CloseProtocol(EFI_HANDLE h, EFI_GUID* guid);
 
+// Load a file from the boot media into pages below 4GB
+// (one page for an empty file, so NULL means it was not loaded)
 void* LoadFile(CHAR16* filename, UINTN* size_out);
 
+// Open a file on the boot media for reading, returning NULL on failure.
+// The caller reads it with ReadFile() and closes it with file->Close().
+// The boot volume is opened once and kept open.
+EFI_FILE_HANDLE OpenFile(CHAR16* filename, UINTN* size_out);
+
+// Read exactly size bytes from the current position of file.
+EFI_STATUS ReadFile(EFI_FILE_HANDLE file, void* data, UINTN size);
+
+// Read exactly size bytes into data in large chunks, calling
+// chunk_done(arg, bytes_so_far) as each one lands.  Where the
+// firmware supports asynchronous file reads, the next chunk is
+// in flight while chunk_done() runs.  A nonzero return from
+// chunk_done() stops the read.
+EFI_STATUS ReadFileChunked(EFI_FILE_HANDLE file, void* data, UINTN size,
+                           int (*chunk_done)(void* arg, UINTN done), void* arg);
+
+// idle() is called between the chunks of large reads from the
+// boot media, so other work (servicing the network, say) goes on
+// while files load.  A nonzero return abandons the read under way.
+// ReadIdle() calls it, if set, for readers outside this library.
+void SetReadIdle(int (*idle)(void));
+int ReadIdle(void);
+
+// As ReadFile() and LoadFile(), also feeding the data to hash
+// (if not NULL) on an AP, if available, behind the read.
+EFI_STATUS ReadFileHashed(EFI_FILE_HANDLE file, void* data, UINTN size, sha256c_ctx* hash);
+void* LoadFileHashed(CHAR16* filename, UINTN* size_out, sha256c_ctx* hash);
+
+// Load an LZ4 frame compressed file (with content size), into
+// pages below 4GB.  Decompression runs on an AP, if available,
+// overlapped with reading the rest of the file.
+void* LoadCompressedFile(CHAR16* filename, UINTN* size_out);
+
+// Boot phase timing, from the TSC calibrated against Stall().
+// TimeMark() records a timestamp under name, which must be a
+// string constant without spaces.  TimeTicksPerSec() calibrates
+// on first use, so it must first be called before ExitBootServices.
+UINT64 TimeTicks(void);
+UINT64 TimeTicksPerSec(void);
+void TimeMark(const char* name);
+
+// Print the marks so far, with the time spent before each.
+void TimeReport(void);
+
+// Format the marks as kernel commandline arguments:
+// "bootloader.tsc_hz=N bootloader.timestamps=name:tsc,..."
+// Safe to use after ExitBootServices.  Returns the length.
+int TimeFormat(char* buf, UINTN len);
+
 // GUIDs
 extern EFI_GUID SimpleFileSystemProtocol;
 extern EFI_GUID FileInfoGUID;
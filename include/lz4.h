@@ -0,0 +1,44 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+// Streaming decoder for the LZ4 frame format (as written by
+// "lz4 --content-size").  Input may arrive in pieces; blocks are
+// decoded as soon as they are complete.  Output goes to a single
+// buffer, so dependent blocks are supported.
+
+typedef struct {
+    uint8_t* out;
+    size_t out_size;
+    size_t out_pos;
+    size_t in_pos;   // input consumed so far
+    uint64_t content_size; // 0 if the frame does not say
+    uint8_t flags;
+    uint8_t done;
+} lz4_frame;
+
+#define LZ4_ERROR -1
+#define LZ4_MORE 0
+#define LZ4_DONE 1
+
+// Parse the frame header at the start of in.  Returns LZ4_MORE
+// if len is too short to hold it.
+int lz4_frame_header(lz4_frame* f, const uint8_t* in, size_t len);
+
+// Decode every complete block in in[f->in_pos, len) into
+// f->out.  Returns LZ4_DONE once the end of the frame is reached.
+int lz4_frame_decode(lz4_frame* f, const uint8_t* in, size_t len);
@@ -0,0 +1,45 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+// Locate the MP Services protocol so that mp_run() can spread
+// work across the application processors.  If the firmware does
+// not provide it, all work runs on the boot processor.
+// Returns the number of processors that will run work.
+unsigned mp_init(void);
+
+// Called once for each index in [0, count), on any processor.
+// These run on APs, so they must not call boot services or printf.
+typedef void (*mp_func_t)(void* arg, size_t index);
+
+// Run func over [0, count) on all processors and wait for it
+// to finish.  Indices are handed out one at a time, so each one
+// should be a sizeable chunk of work (a megabyte or so).
+void mp_run(mp_func_t func, void* arg, size_t count);
+
+// Start func(arg, 0) on an AP and return without waiting, so
+// the caller can overlap it with firmware calls (which must stay
+// on the BSP).  Only one such task may be outstanding.  Without
+// an AP, func runs to completion before mp_start() returns.
+void mp_start(mp_func_t func, void* arg);
+
+// Wait for the task started by mp_start(), if any.
+void mp_wait(void);
+
+// Bulk memory helpers built on mp_run()
+void mp_memset(void* dst, int c, size_t n);
+void mp_memcpy(void* dst, const void* src, size_t n);
@@ -0,0 +1,36 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#define SERIAL_COM1 0x3F8
+
+// Program the 16550 UART at I/O port base for baud 8N1, with
+// FIFOs enabled.  Returns -1 if there is no UART there.
+int serial_init(uint16_t base, unsigned baud);
+
+// Queue len characters (adding \r before \n) in the transmit
+// ring, and send as many as the UART will take without waiting.
+// Waits only if the ring is full.
+void serial_write(const char* str, size_t len);
+
+// Wait until everything queued has been handed to the UART.
+void serial_flush(void);
+
+// Hand the UART up to a fifo's worth of what is queued, if it has
+// room, without waiting.  Returns 0 if it was busy.  For idle points
+// that must not stall (serial_flush() can take over a second).
+int serial_kick(void);
@@ -0,0 +1,70 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+// Engines, chosen by CPUID on first use: SHA extensions, else
+// AVX2 (which only helps when hashing 8 messages at once), else
+// portable C.
+#define SHA256_GENERIC 0
+#define SHA256_AVX2 1
+#define SHA256_SHANI 2
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t count; // bytes hashed
+    uint8_t buf[SHA256_BLOCK_SIZE];
+} sha256_ctx;
+
+void sha256_init(sha256_ctx* ctx);
+void sha256_update(sha256_ctx* ctx, const void* data, size_t len);
+void sha256_final(sha256_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// The engine in use, and a way to pick a lesser one (for testing).
+int sha256_engine(void);
+const char* sha256_engine_name(void);
+void sha256_set_engine(int engine);
+
+// Chunked digest, used to verify boot images: the SHA-256 of the
+// concatenated SHA-256 digests of each SHA256C_CHUNK bytes of the
+// data (the last chunk may be short; empty data has no chunks).
+// Chunks hash independently, so they can be spread across CPUs and
+// AVX2 lanes, and hashed as they arrive.
+#define SHA256C_CHUNK (2 * 1024 * 1024)
+
+typedef struct {
+    sha256_ctx outer;
+    sha256_ctx chunk;
+    size_t chunk_len;
+} sha256c_ctx;
+
+// Streaming form, for data that arrives in order.
+void sha256c_init(sha256c_ctx* ctx);
+void sha256c_update(sha256c_ctx* ctx, const void* data, size_t len);
+void sha256c_final(sha256c_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Digest chunks [first, last) of a buffer of len bytes (on all CPUs,
+// via mp_run()), into digests[first..last).  Whole-buffer hashing
+// and hashing behind a loader are built from this.
+void sha256c_chunks(const void* data, size_t len, size_t first, size_t last,
+                    uint8_t (*digests)[SHA256_DIGEST_SIZE]);
+
+// Digest a whole buffer.
+void sha256c(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
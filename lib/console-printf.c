@@ -17,11 +17,41 @@
 #include <efi.h>
 #include <efilib.h>
 #include <goodies.h>
+#include <string.h>
 
 #define PCBUFMAX 126
 // buffer is two larger to leave room for a \0 and room
 // for a \r that may be added after a \n
 
+// when any are added, printf() output goes to these instead of ConOut
+#define CONSOLE_MAX 4
+
+static struct {
+    void (*write)(const char* str, size_t len);
+    void (*flush)(void);
+} consoles[CONSOLE_MAX];
+static int console_count;
+
+int AddConsoleOutput(void (*write)(const char* str, size_t len), void (*flush)(void)) {
+    if (console_count == CONSOLE_MAX) {
+        return -1;
+    }
+    consoles[console_count].write = write;
+    consoles[console_count].flush = flush;
+    console_count++;
+    return 0;
+}
+
+void ConsoleFlush(void) {
+    int i;
+    LogFlush();
+    for (i = 0; i < console_count; i++) {
+        if (consoles[i].flush) {
+            consoles[i].flush();
+        }
+    }
+}
+
 typedef struct {
     int off;
     CHAR16 buf[PCBUFMAX + 2];
@@ -48,10 +78,157 @@ static int _printf_console_out(const char* str, size_t len, void* _state) {
     return len;
 }
 
+static int _printf_direct_out(const char* str, size_t len, void* state) {
+    int i;
+    for (i = 0; i < console_count; i++) {
+        consoles[i].write(str, len);
+    }
+    return len;
+}
+
+static void console_write(const char* str, size_t len) {
+    _pcstate state;
+    if (console_count) {
+        _printf_direct_out(str, len, NULL);
+        return;
+    }
+    state.off = 0;
+    _printf_console_out(str, len, &state);
+    if (state.off) {
+        state.buf[state.off] = 0;
+        gConOut->OutputString(gConOut, state.buf);
+    }
+}
+
+// Once LogInit() is called, all output is kept in a ring in memory,
+// and written to the console right away unless quiet.  Quiet output
+// reaches the console when LogFlush() is called at idle points, or
+// when the ring would otherwise overwrite lines not yet written.
+static bootlog* log;
+static uint64_t log_flushed;
+static int log_quiet;
+
+int LogInit(size_t size) {
+    EFI_PHYSICAL_ADDRESS mem = 0xFFFFFFFF;
+    size_t pages = EFI_SIZE_TO_PAGES(sizeof(bootlog) + size);
+
+    if (log) {
+        return 0;
+    }
+    if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, pages, &mem)) {
+        return -1;
+    }
+    log = (void*)mem;
+    log->magic = BOOTLOG_MAGIC;
+    log->size = (pages * 4096) - sizeof(bootlog);
+    log->written = 0;
+    log_flushed = 0;
+    return 0;
+}
+
+void LogSetQuiet(int quiet) {
+    log_quiet = quiet;
+    if (!quiet) {
+        LogFlush();
+    }
+}
+
+bootlog* LogBuffer(void) {
+    return log;
+}
+
+void LogFlush(void) {
+    uint64_t from;
+    size_t off, len;
+
+    if (log == NULL) {
+        return;
+    }
+    from = log_flushed;
+    if ((log->written - from) > log->size) {
+        from = log->written - log->size;
+    }
+    while (from < log->written) {
+        off = from % log->size;
+        len = log->written - from;
+        if (len > (log->size - off)) {
+            len = log->size - off;
+        }
+        console_write(log->data + off, len);
+        from += len;
+    }
+    log_flushed = log->written;
+}
+
+size_t LogRead(uint64_t* offset, void* data, size_t len) {
+    uint64_t off = *offset;
+    size_t n;
+
+    if (log == NULL) {
+        return 0;
+    }
+    if ((log->written - off) > log->size) {
+        // overwritten already; skip ahead
+        off = log->written - log->size;
+    }
+    if (off >= log->written) {
+        return 0;
+    }
+    n = log->size - (off % log->size);
+    if (n > (log->written - off)) {
+        n = log->written - off;
+    }
+    if (n > len) {
+        n = len;
+    }
+    memcpy(data, log->data + (off % log->size), n);
+    *offset = off;
+    return n;
+}
+
+static int _printf_log_out(const char* str, size_t len, void* state) {
+    size_t n, off, todo = len;
+
+    while (todo > 0) {
+        // never overwrite what the console has not seen yet
+        if ((log->written - log_flushed) >= log->size) {
+            LogFlush();
+        }
+        off = log->written % log->size;
+        n = log->size - off;
+        if (n > (log->size - (log->written - log_flushed))) {
+            n = log->size - (log->written - log_flushed);
+        }
+        if (n > todo) {
+            n = todo;
+        }
+        memcpy(log->data + off, str, n);
+        log->written += n;
+        str += n;
+        todo -= n;
+    }
+    return len;
+}
+
 int _printf(const char* fmt, ...) {
     va_list ap;
     _pcstate state;
     int r;
+    if (log) {
+        va_start(ap, fmt);
+        r = _printf_engine(_printf_log_out, NULL, fmt, ap);
+        va_end(ap);
+        if (!log_quiet) {
+            LogFlush();
+        }
+        return r;
+    }
+    if (console_count) {
+        va_start(ap, fmt);
+        r = _printf_engine(_printf_direct_out, NULL, fmt, ap);
+        va_end(ap);
+        return r;
+    }
     state.off = 0;
     va_start(ap, fmt);
     r = _printf_engine(_printf_console_out, &state, fmt, ap);
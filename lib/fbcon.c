@@ -0,0 +1,145 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <efi.h>
+#include <efilib.h>
+#include <string.h>
+
+#include <fbcon.h>
+#include <goodies.h>
+
+extern const uint8_t fbcon_font[95][8];
+
+// each font row is drawn twice, for an 8x16 cell
+#define CELL_W 8
+#define CELL_H 16
+
+#define FG 0x00C0C0C0 // grey, in either RGB or BGR order
+#define BG 0x00000000
+
+static uint32_t* fb;
+static uint32_t stride; // in pixels
+static unsigned cols, rows;
+static unsigned cx, cy;
+
+// the characters that should be on screen, and those that are,
+// so that scrolling only redraws the cells that change
+static uint8_t* text;
+static uint8_t* shown;
+
+static void draw_cell(unsigned x, unsigned y, uint8_t c) {
+    const uint8_t* glyph = fbcon_font[((c < 32) || (c > 126)) ? 0 : (c - 32)];
+    uint32_t* p = fb + (y * CELL_H * stride) + (x * CELL_W);
+    unsigned r, i;
+    uint8_t bits;
+
+    for (r = 0; r < CELL_H; r++, p += stride) {
+        bits = glyph[r / 2];
+        for (i = 0; i < CELL_W; i++) {
+            p[i] = (bits & (0x80 >> i)) ? FG : BG;
+        }
+    }
+    shown[(y * cols) + x] = c;
+}
+
+static void refresh(void) {
+    unsigned x, y, n;
+
+    for (y = 0, n = 0; y < rows; y++) {
+        for (x = 0; x < cols; x++, n++) {
+            if (text[n] != shown[n]) {
+                draw_cell(x, y, text[n]);
+            }
+        }
+    }
+}
+
+static void newline(void) {
+    cx = 0;
+    if (++cy < rows) {
+        return;
+    }
+    cy = rows - 1;
+    memmove(text, text + cols, cols * (rows - 1));
+    memset(text + cols * (rows - 1), ' ', cols);
+    refresh();
+}
+
+static void putc(char c) {
+    switch (c) {
+    case '\n':
+        newline();
+        return;
+    case '\r':
+        cx = 0;
+        return;
+    case '\t':
+        do {
+            putc(' ');
+        } while (cx & 7);
+        return;
+    }
+    if ((c < 32) || (c > 126)) {
+        return;
+    }
+    if (cx == cols) {
+        newline();
+    }
+    text[(cy * cols) + cx] = c;
+    draw_cell(cx, cy, c);
+    cx++;
+}
+
+void fbcon_write(const char* str, size_t len) {
+    while (len-- > 0) {
+        putc(*str++);
+    }
+}
+
+int fbcon_init(EFI_GRAPHICS_OUTPUT_PROTOCOL* gop) {
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info;
+    unsigned y, height;
+
+    if ((gop == NULL) || (gop->Mode == NULL) || (gop->Mode->Info == NULL)) {
+        return -1;
+    }
+    info = gop->Mode->Info;
+    if ((info->PixelFormat != PixelRedGreenBlueReserved8BitPerColor) &&
+        (info->PixelFormat != PixelBlueGreenRedReserved8BitPerColor)) {
+        return -1;
+    }
+    cols = info->HorizontalResolution / CELL_W;
+    rows = info->VerticalResolution / CELL_H;
+    if ((cols == 0) || (rows == 0)) {
+        return -1;
+    }
+    if (text == NULL) {
+        if (gBS->AllocatePool(EfiLoaderData, 2 * cols * rows, (void**)&text)) {
+            text = NULL;
+            return -1;
+        }
+        shown = text + (cols * rows);
+    }
+    fb = (void*)gop->Mode->FrameBufferBase;
+    stride = info->PixelsPerScanLine;
+
+    height = info->VerticalResolution;
+    for (y = 0; y < height; y++) {
+        memset(fb + (y * stride), 0, info->HorizontalResolution * 4);
+    }
+    memset(text, ' ', 2 * cols * rows);
+    cx = 0;
+    cy = 0;
+    return 0;
+}
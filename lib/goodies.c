@@ -39,6 +39,7 @@ void InitGoodies(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
 void WaitAnyKey(void) {
     SIMPLE_INPUT_INTERFACE* sii = gSys->ConIn;
     EFI_INPUT_KEY key;
+    ConsoleFlush();
     while (sii->ReadKeyStroke(sii, &key) != EFI_SUCCESS)
         ;
 }
@@ -67,3 +68,83 @@ EFI_STATUS OpenProtocol(EFI_HANDLE h, EFI_GUID* guid, void** ifc) {
 EFI_STATUS CloseProtocol(EFI_HANDLE h, EFI_GUID* guid) {
     return gBS->CloseProtocol(h, guid, gImg, NULL);
 }
+
+#define TIME_MARKS_MAX 32
+
+static struct {
+    const char* name;
+    UINT64 tsc;
+} time_marks[TIME_MARKS_MAX];
+static unsigned time_count;
+static UINT64 tsc_hz;
+
+UINT64 TimeTicks(void) {
+    UINT32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+UINT64 TimeTicksPerSec(void) {
+    if (tsc_hz == 0) {
+        UINT64 t0 = TimeTicks();
+        gBS->Stall(10000);
+        tsc_hz = (TimeTicks() - t0) * 100;
+    }
+    return tsc_hz;
+}
+
+void TimeMark(const char* name) {
+    if (time_count < TIME_MARKS_MAX) {
+        time_marks[time_count].name = name;
+        time_marks[time_count].tsc = TimeTicks();
+        time_count++;
+    }
+}
+
+static UINT64 ticks_to_us(UINT64 ticks) {
+    return ticks * 1000000 / TimeTicksPerSec();
+}
+
+void TimeReport(void) {
+    UINT64 prev = 0;
+    UINT64 us;
+    unsigned i;
+
+    // the TSC starts at reset, so the first mark includes firmware time
+    printf("phase             ms   total ms\n");
+    for (i = 0; i < time_count; i++) {
+        us = ticks_to_us(time_marks[i].tsc - prev);
+        printf("%-12s %5ld.%03ld", time_marks[i].name, us / 1000, us % 1000);
+        us = ticks_to_us(time_marks[i].tsc);
+        printf(" %6ld.%03ld\n", us / 1000, us % 1000);
+        prev = time_marks[i].tsc;
+    }
+}
+
+int TimeFormat(char* buf, UINTN len) {
+    UINTN n;
+    unsigned i;
+    int r;
+
+    r = snprintf(buf, len, "bootloader.tsc_hz=%ld bootloader.timestamps=", tsc_hz);
+    if ((r < 0) || ((UINTN)r >= len)) {
+        goto truncated;
+    }
+    n = r;
+    for (i = 0; i < time_count; i++) {
+        r = snprintf(buf + n, len - n, "%s%s:%ld", i ? "," : "",
+                     time_marks[i].name, time_marks[i].tsc);
+        if ((r < 0) || ((UINTN)r >= (len - n))) {
+            goto truncated;
+        }
+        n += r;
+    }
+    return n;
+
+truncated:
+    // leave no partial argument behind
+    if (len) {
+        buf[0] = 0;
+    }
+    return 0;
+}
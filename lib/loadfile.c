@@ -15,12 +15,54 @@
 #include <efi.h>
 #include <efilib.h>
 #include <goodies.h>
+#include <lz4.h>
+#include <mp.h>
 #include <stdio.h>
+#include <string.h>
 
-void* LoadFile(CHAR16* filename, UINTN* _sz) {
+// EFI_FILE_PROTOCOL revision 2 adds asynchronous I/O, which
+// gnu-efi's EFI_FILE does not describe
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+
+typedef struct {
+    EFI_EVENT Event;
+    EFI_STATUS Status;
+    UINTN BufferSize;
+    VOID* Buffer;
+} EFI_FILE_IO_TOKEN;
+
+typedef struct {
+    EFI_FILE f;
+    EFI_STATUS (EFIAPI *OpenEx)(EFI_FILE_HANDLE file, EFI_FILE_HANDLE* newfile,
+                                CHAR16* name, UINT64 mode, UINT64 attr,
+                                EFI_FILE_IO_TOKEN* token);
+    EFI_STATUS (EFIAPI *ReadEx)(EFI_FILE_HANDLE file, EFI_FILE_IO_TOKEN* token);
+    EFI_STATUS (EFIAPI *WriteEx)(EFI_FILE_HANDLE file, EFI_FILE_IO_TOKEN* token);
+    EFI_STATUS (EFIAPI *FlushEx)(EFI_FILE_HANDLE file, EFI_FILE_IO_TOKEN* token);
+} EFI_FILE2;
+
+#define READ_CHUNK (2 * 1024 * 1024)
+
+static int (*read_idle)(void);
+
+void SetReadIdle(int (*idle)(void)) {
+    read_idle = idle;
+}
+
+int ReadIdle(void) {
+    return read_idle ? read_idle() : 0;
+}
+
+// root of the volume we were loaded from, opened on first use
+static EFI_FILE_HANDLE boot_root;
+
+static EFI_FILE_HANDLE OpenBootVolume(void) {
     EFI_LOADED_IMAGE* loaded;
     EFI_STATUS r;
-    void* data = NULL;
+
+    if (boot_root) {
+        return boot_root;
+    }
 
     r = OpenProtocol(gImg, &LoadedImageProtocol, (void**)&loaded);
     if (r) {
@@ -41,18 +83,32 @@ void* LoadFile(CHAR16* filename, UINTN* _sz) {
         goto exit1;
     }
 
-    EFI_FILE_HANDLE root;
-    r = fioi->OpenVolume(fioi, &root);
+    r = fioi->OpenVolume(fioi, &boot_root);
     if (r) {
         printf("LoadFile: Cannot open root volume (%ld)\n", r);
-        goto exit2;
+        boot_root = NULL;
     }
 
+    CloseProtocol(loaded->DeviceHandle, &SimpleFileSystemProtocol);
+exit1:
+    CloseProtocol(gImg, &LoadedImageProtocol);
+exit0:
+    return boot_root;
+}
+
+EFI_FILE_HANDLE OpenFile(CHAR16* filename, UINTN* _sz) {
+    EFI_FILE_HANDLE root;
     EFI_FILE_HANDLE file;
+    EFI_STATUS r;
+
+    if ((root = OpenBootVolume()) == NULL) {
+        return NULL;
+    }
+
     r = root->Open(root, &file, filename, EFI_FILE_MODE_READ, 0);
     if (r) {
         printf("LoadFile: Cannot open file (%ld)\n", r);
-        goto exit3;
+        return NULL;
     }
 
     char buf[512];
@@ -61,39 +117,262 @@ void* LoadFile(CHAR16* filename, UINTN* _sz) {
     r = file->GetInfo(file, &FileInfoGUID, &sz, finfo);
     if (r) {
         printf("LoadFile: Cannot get FileInfo (%ld)\n", r);
-        goto exit3;
+        file->Close(file);
+        return NULL;
     }
+    *_sz = finfo->FileSize;
+    return file;
+}
 
-    r = gBS->AllocatePool(EfiLoaderData, finfo->FileSize, (void**)&data);
-    if (r) {
-        printf("LoadFile: Cannot allocate buffer (%ld)\n", r);
-        data = NULL;
-        goto exit4;
+// A single chunk read, which is asynchronous when the
+// file protocol supports it
+typedef struct {
+    EFI_FILE_HANDLE file;
+    EFI_FILE_IO_TOKEN token;
+    int async;
+    UINTN len;
+    UINTN got;
+    EFI_STATUS status;
+} chunk_read;
+
+static void ReadStart(chunk_read* rd, void* data, UINTN len) {
+    rd->len = len;
+    if (rd->async) {
+        rd->token.Buffer = data;
+        rd->token.BufferSize = len;
+        rd->token.Status = EFI_SUCCESS;
+        rd->status = ((EFI_FILE2*)rd->file)->ReadEx(rd->file, &rd->token);
+        if (rd->status != EFI_UNSUPPORTED) {
+            return;
+        }
+        // fall back to blocking reads
+        gBS->CloseEvent(rd->token.Event);
+        rd->async = 0;
     }
+    rd->got = len;
+    rd->status = rd->file->Read(rd->file, &rd->got, data);
+}
 
-    sz = finfo->FileSize;
-    r = file->Read(file, &sz, data);
-    if (r) {
-        printf("LoadFile: Error reading file (%ld)\n", r);
-        gBS->FreePool(data);
-        data = NULL;
-        goto exit4;
+static EFI_STATUS ReadFinish(chunk_read* rd) {
+    UINTN n;
+
+    if (rd->async && (rd->status == EFI_SUCCESS)) {
+        gBS->WaitForEvent(1, &rd->token.Event, &n);
+        rd->status = rd->token.Status;
+        rd->got = rd->token.BufferSize;
     }
-    if (sz != finfo->FileSize) {
+    if (rd->status) {
+        printf("LoadFile: Error reading file (%ld)\n", rd->status);
+        return rd->status;
+    }
+    if (rd->got != rd->len) {
         printf("LoadFile: Short read\n");
-        gBS->FreePool(data);
+        return EFI_END_OF_FILE;
+    }
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS ReadFileChunked(EFI_FILE_HANDLE file, void* _data, UINTN size,
+                           int (*chunk_done)(void* arg, UINTN done), void* arg) {
+    uint8_t* data = _data;
+    chunk_read rd;
+    EFI_STATUS r = EFI_SUCCESS;
+    UINTN off = 0;
+    int more;
+
+    rd.file = file;
+    rd.async = 0;
+    if ((file->Revision >= EFI_FILE_PROTOCOL_REVISION2) &&
+        (gBS->CreateEvent(0, 0, NULL, NULL, &rd.token.Event) == EFI_SUCCESS)) {
+        rd.async = 1;
+    }
+
+    if (size > 0) {
+        ReadStart(&rd, data, (size < READ_CHUNK) ? size : READ_CHUNK);
+    }
+    while (off < size) {
+        if ((r = ReadFinish(&rd))) {
+            break;
+        }
+        off += rd.len;
+
+        // keep the next chunk in flight while this one is consumed
+        more = (off < size);
+        if (more) {
+            ReadStart(&rd, data + off, ((size - off) < READ_CHUNK) ? (size - off) : READ_CHUNK);
+        }
+        if ((chunk_done && chunk_done(arg, off)) || ReadIdle()) {
+            if (more) {
+                ReadFinish(&rd);
+            }
+            r = EFI_ABORTED;
+            break;
+        }
+    }
+
+    if (rd.async) {
+        gBS->CloseEvent(rd.token.Event);
+    }
+    return r;
+}
+
+EFI_STATUS ReadFile(EFI_FILE_HANDLE file, void* data, UINTN size) {
+    return ReadFileChunked(file, data, size, NULL, NULL);
+}
+
+typedef struct {
+    sha256c_ctx* ctx;
+    const uint8_t* data;
+    UINTN hashed;
+    UINTN avail;
+} hash_job;
+
+static void hash_job_run(void* arg, size_t index) {
+    hash_job* job = arg;
+    sha256c_update(job->ctx, job->data + job->hashed, job->avail - job->hashed);
+    job->hashed = job->avail;
+}
+
+// Called as each chunk arrives: hash it while the next is read.
+static int hash_chunk_done(void* arg, UINTN done) {
+    hash_job* job = arg;
+
+    mp_wait();
+    job->avail = done;
+    mp_start(hash_job_run, job);
+    return 0;
+}
+
+EFI_STATUS ReadFileHashed(EFI_FILE_HANDLE file, void* data, UINTN size, sha256c_ctx* hash) {
+    hash_job job;
+    EFI_STATUS r;
+
+    if (hash == NULL) {
+        return ReadFile(file, data, size);
+    }
+    job.ctx = hash;
+    job.data = data;
+    job.hashed = 0;
+    job.avail = 0;
+    r = ReadFileChunked(file, data, size, hash_chunk_done, &job);
+    mp_wait();
+    return r;
+}
+
+void* LoadFile(CHAR16* filename, UINTN* _sz) {
+    return LoadFileHashed(filename, _sz, NULL);
+}
+
+void* LoadFileHashed(CHAR16* filename, UINTN* _sz, sha256c_ctx* hash) {
+    EFI_FILE_HANDLE file;
+    EFI_PHYSICAL_ADDRESS mem;
+    void* data = NULL;
+    UINTN sz, pages;
+
+    if ((file = OpenFile(filename, &sz)) == NULL) {
+        return NULL;
+    }
+
+    // an empty file still gets a buffer, so it is not taken for missing
+    pages = sz ? EFI_SIZE_TO_PAGES(sz) : 1;
+    mem = 0xFFFFFFFF;
+    if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, pages, &mem)) {
+        printf("LoadFile: Cannot allocate buffer\n");
+        goto exit;
+    }
+    data = (void*)mem;
+
+    if (ReadFileHashed(file, data, sz, hash)) {
+        gBS->FreePages(mem, pages);
         data = NULL;
-        goto exit4;
+        goto exit;
     }
-    *_sz = finfo->FileSize;
-exit4:
+    *_sz = sz;
+exit:
     file->Close(file);
-exit3:
-    root->Close(root);
-exit2:
-    CloseProtocol(loaded->DeviceHandle, &SimpleFileSystemProtocol);
-exit1:
-    CloseProtocol(gImg, &LoadedImageProtocol);
-exit0:
     return data;
 }
+
+typedef struct {
+    lz4_frame frame;
+    const uint8_t* in;
+    size_t avail;
+    int status;
+} lz4_job;
+
+static void lz4_job_run(void* arg, size_t index) {
+    lz4_job* job = arg;
+    job->status = lz4_frame_decode(&job->frame, job->in, job->avail);
+}
+
+// Called as each chunk of compressed data arrives: restart
+// the decoder (on an AP, if there is one) over the new data.
+static int lz4_chunk_done(void* arg, UINTN done) {
+    lz4_job* job = arg;
+    EFI_PHYSICAL_ADDRESS mem;
+
+    mp_wait();
+    if (job->status == LZ4_ERROR) {
+        return -1;
+    }
+    if (job->frame.out == NULL) {
+        if ((lz4_frame_header(&job->frame, job->in, done) != LZ4_DONE) ||
+            (job->frame.content_size == 0)) {
+            printf("LoadFile: Not an LZ4 frame with content size\n");
+            return -1;
+        }
+        mem = 0xFFFFFFFF;
+        if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData,
+                               EFI_SIZE_TO_PAGES(job->frame.content_size), &mem)) {
+            printf("LoadFile: Cannot allocate %ld bytes\n", job->frame.content_size);
+            return -1;
+        }
+        job->frame.out = (void*)mem;
+        job->frame.out_size = job->frame.content_size;
+    }
+    job->avail = done;
+    mp_start(lz4_job_run, job);
+    return 0;
+}
+
+void* LoadCompressedFile(CHAR16* filename, UINTN* _sz) {
+    EFI_FILE_HANDLE file;
+    uint8_t* in = NULL;
+    lz4_job job;
+    EFI_STATUS r;
+    UINTN sz;
+
+    if ((file = OpenFile(filename, &sz)) == NULL) {
+        return NULL;
+    }
+
+    if (gBS->AllocatePool(EfiLoaderData, sz, (void**)&in)) {
+        printf("LoadFile: Cannot allocate buffer\n");
+        file->Close(file);
+        return NULL;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.in = in;
+    job.status = LZ4_MORE;
+
+    r = ReadFileChunked(file, in, sz, lz4_chunk_done, &job);
+    mp_wait();
+    if ((r == EFI_SUCCESS) &&
+        ((job.status != LZ4_DONE) || (job.frame.out_pos != job.frame.content_size))) {
+        printf("LoadFile: Corrupt LZ4 data\n");
+        r = EFI_COMPROMISED_DATA;
+    }
+
+    gBS->FreePool(in);
+    file->Close(file);
+    if (r) {
+        if (job.frame.out) {
+            gBS->FreePages((EFI_PHYSICAL_ADDRESS)job.frame.out,
+                           EFI_SIZE_TO_PAGES(job.frame.content_size));
+        }
+        return NULL;
+    }
+    *_sz = job.frame.content_size;
+    return job.frame.out;
+}
@@ -0,0 +1,181 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <lz4.h>
+#include <string.h>
+
+#define LZ4_MAGIC 0x184D2204
+
+#define FLG_VERSION_MASK 0xC0
+#define FLG_VERSION 0x40
+#define FLG_BLOCK_CHECKSUM 0x10
+#define FLG_CONTENT_SIZE 0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_DICT_ID 0x01
+
+#define BLOCK_UNCOMPRESSED 0x80000000
+
+static uint32_t rd32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int lz4_frame_header(lz4_frame* f, const uint8_t* in, size_t len) {
+    size_t hlen = 7;
+    uint8_t flg;
+
+    if (len < hlen) {
+        return LZ4_MORE;
+    }
+    if (rd32(in) != LZ4_MAGIC) {
+        return LZ4_ERROR;
+    }
+    flg = in[4];
+    if ((flg & FLG_VERSION_MASK) != FLG_VERSION) {
+        return LZ4_ERROR;
+    }
+    if (flg & FLG_CONTENT_SIZE) {
+        hlen += 8;
+    }
+    if (flg & FLG_DICT_ID) {
+        // we have no dictionaries to offer
+        return LZ4_ERROR;
+    }
+    if (len < hlen) {
+        return LZ4_MORE;
+    }
+    f->content_size = 0;
+    if (flg & FLG_CONTENT_SIZE) {
+        f->content_size = rd32(in + 6) | ((uint64_t)rd32(in + 10) << 32);
+    }
+    f->flags = flg;
+    f->in_pos = hlen;
+    f->out_pos = 0;
+    f->done = 0;
+    return LZ4_DONE;
+}
+
+// Decode one block.  Matches may refer back to anywhere in the
+// output decoded so far.
+static int lz4_block(lz4_frame* f, const uint8_t* ip, size_t len) {
+    const uint8_t* iend = ip + len;
+    uint8_t* op = f->out + f->out_pos;
+    uint8_t* oend = f->out + f->out_size;
+    size_t lit, mlen, off;
+    unsigned token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) {
+                    return LZ4_ERROR;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((lit > (size_t)(iend - ip)) || (lit > (size_t)(oend - op))) {
+            return LZ4_ERROR;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        // the last sequence is literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if ((iend - ip) < 2) {
+            return LZ4_ERROR;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((off == 0) || (off > (size_t)(op - f->out))) {
+            return LZ4_ERROR;
+        }
+
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) {
+                    return LZ4_ERROR;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (mlen > (size_t)(oend - op)) {
+            return LZ4_ERROR;
+        }
+
+        // matches may overlap their own output
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0) {
+                *op = *(op - off);
+                op++;
+            }
+        }
+    }
+    f->out_pos = op - f->out;
+    return LZ4_MORE;
+}
+
+int lz4_frame_decode(lz4_frame* f, const uint8_t* in, size_t len) {
+    size_t pos = f->in_pos;
+    size_t bsz, need;
+    uint32_t n;
+
+    if (f->done) {
+        return LZ4_DONE;
+    }
+    for (;;) {
+        if ((len - pos) < 4) {
+            return LZ4_MORE;
+        }
+        n = rd32(in + pos);
+        if (n == 0) {
+            // end mark, then the optional content checksum
+            need = 4 + ((f->flags & FLG_CONTENT_CHECKSUM) ? 4 : 0);
+            if ((len - pos) < need) {
+                return LZ4_MORE;
+            }
+            f->in_pos = pos + need;
+            f->done = 1;
+            return LZ4_DONE;
+        }
+        bsz = n & ~BLOCK_UNCOMPRESSED;
+        need = 4 + bsz + ((f->flags & FLG_BLOCK_CHECKSUM) ? 4 : 0);
+        if ((len - pos) < need) {
+            return LZ4_MORE;
+        }
+        if (n & BLOCK_UNCOMPRESSED) {
+            if (bsz > (f->out_size - f->out_pos)) {
+                return LZ4_ERROR;
+            }
+            memcpy(f->out + f->out_pos, in + pos + 4, bsz);
+            f->out_pos += bsz;
+        } else if (lz4_block(f, in + pos + 4, bsz) == LZ4_ERROR) {
+            return LZ4_ERROR;
+        }
+        pos += need;
+        f->in_pos = pos;
+    }
+}
@@ -0,0 +1,184 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <efi.h>
+#include <efilib.h>
+#include <goodies.h>
+#include <mp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <Protocol/MpService.h>
+
+static EFI_GUID MpServicesProtocol = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+static EFI_MP_SERVICES_PROTOCOL* mp;
+static unsigned mp_cpus = 1;
+
+// the AP used by mp_start()
+static UINTN mp_ap;
+static EFI_EVENT mp_task_done;
+
+typedef struct {
+    mp_func_t func;
+    void* arg;
+    size_t count;
+    size_t next;
+} mp_job;
+
+static void mp_work(mp_job* job) {
+    size_t n;
+    while ((n = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        job->func(job->arg, n);
+    }
+}
+
+static EFIAPI void mp_ap_entry(void* arg) {
+    mp_work(arg);
+}
+
+unsigned mp_init(void) {
+    EFI_PROCESSOR_INFORMATION info;
+    UINTN total, enabled;
+
+    if (gBS->LocateProtocol(&MpServicesProtocol, NULL, (void**)&mp)) {
+        printf("mp: no MP services, using 1 processor\n");
+        mp = NULL;
+        return mp_cpus;
+    }
+    if (mp->GetNumberOfProcessors(mp, &total, &enabled) || (enabled < 2)) {
+        mp = NULL;
+        return mp_cpus;
+    }
+    for (mp_ap = 0; mp_ap < total; mp_ap++) {
+        if (mp->GetProcessorInfo(mp, mp_ap, &info)) {
+            continue;
+        }
+        if ((info.StatusFlag & PROCESSOR_ENABLED_BIT) &&
+            !(info.StatusFlag & PROCESSOR_AS_BSP_BIT)) {
+            break;
+        }
+    }
+    if (mp_ap == total) {
+        mp = NULL;
+        return mp_cpus;
+    }
+    mp_cpus = enabled;
+    printf("mp: %d of %d processors available\n", (int)enabled, (int)total);
+    return mp_cpus;
+}
+
+void mp_run(mp_func_t func, void* arg, size_t count) {
+    mp_job job = {
+        .func = func,
+        .arg = arg,
+        .count = count,
+        .next = 0,
+    };
+    EFI_EVENT done = NULL;
+    UINTN n;
+
+    // start the APs without waiting, so this processor
+    // can take its share of the work
+    if (mp && (count > 1)) {
+        if (gBS->CreateEvent(0, 0, NULL, NULL, &done) == EFI_SUCCESS) {
+            if (mp->StartupAllAPs(mp, mp_ap_entry, FALSE, done, 0, &job, NULL)) {
+                gBS->CloseEvent(done);
+                done = NULL;
+            }
+        }
+    }
+
+    mp_work(&job);
+
+    if (done) {
+        gBS->WaitForEvent(1, &done, &n);
+        gBS->CloseEvent(done);
+    }
+}
+
+static mp_job mp_task;
+
+void mp_start(mp_func_t func, void* arg) {
+    mp_task.func = func;
+    mp_task.arg = arg;
+    mp_task.count = 1;
+    mp_task.next = 0;
+
+    if (mp && (gBS->CreateEvent(0, 0, NULL, NULL, &mp_task_done) == EFI_SUCCESS)) {
+        if (mp->StartupThisAP(mp, mp_ap_entry, mp_ap, mp_task_done, 0, &mp_task, NULL) == EFI_SUCCESS) {
+            return;
+        }
+        gBS->CloseEvent(mp_task_done);
+    }
+    mp_task_done = NULL;
+    mp_work(&mp_task);
+}
+
+void mp_wait(void) {
+    UINTN n;
+
+    if (mp_task_done) {
+        gBS->WaitForEvent(1, &mp_task_done, &n);
+        gBS->CloseEvent(mp_task_done);
+        mp_task_done = NULL;
+    }
+}
+
+#define MP_CHUNK (1024 * 1024)
+
+typedef struct {
+    uint8_t* dst;
+    const uint8_t* src;
+    int c;
+    size_t n;
+} mp_mem_args;
+
+static void mp_memset_chunk(void* _args, size_t index) {
+    mp_mem_args* args = _args;
+    size_t off = index * MP_CHUNK;
+    size_t len = args->n - off;
+    if (len > MP_CHUNK) {
+        len = MP_CHUNK;
+    }
+    memset(args->dst + off, args->c, len);
+}
+
+static void mp_memcpy_chunk(void* _args, size_t index) {
+    mp_mem_args* args = _args;
+    size_t off = index * MP_CHUNK;
+    size_t len = args->n - off;
+    if (len > MP_CHUNK) {
+        len = MP_CHUNK;
+    }
+    memcpy(args->dst + off, args->src + off, len);
+}
+
+void mp_memset(void* dst, int c, size_t n) {
+    mp_mem_args args = {
+        .dst = dst,
+        .c = c,
+        .n = n,
+    };
+    mp_run(mp_memset_chunk, &args, (n + MP_CHUNK - 1) / MP_CHUNK);
+}
+
+void mp_memcpy(void* dst, const void* src, size_t n) {
+    mp_mem_args args = {
+        .dst = dst,
+        .src = src,
+        .n = n,
+    };
+    mp_run(mp_memcpy_chunk, &args, (n + MP_CHUNK - 1) / MP_CHUNK);
+}
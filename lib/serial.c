@@ -0,0 +1,124 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <serial.h>
+
+// 16550 registers, as offsets from the base port
+#define UART_THR 0 // transmit holding (DLAB=0)
+#define UART_DLL 0 // divisor latch low (DLAB=1)
+#define UART_IER 1 // interrupt enable (DLAB=0)
+#define UART_DLM 1 // divisor latch high (DLAB=1)
+#define UART_FCR 2 // fifo control (write)
+#define UART_IIR 2 // interrupt identification (read)
+#define UART_LCR 3 // line control
+#define UART_MCR 4 // modem control
+#define UART_LSR 5 // line status
+#define UART_SCR 7 // scratch
+
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+#define LSR_THRE 0x20 // transmit holding register (and fifo) empty
+
+#define UART_CLOCK 115200
+
+// transmit ring; a power of two
+#define RING_SIZE 16384
+
+static uint16_t uart;
+static unsigned fifo_size;
+static char ring[RING_SIZE];
+static unsigned head; // next slot to fill
+static unsigned tail; // next slot to send
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile("outb %0, %1" ::"a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t val;
+    __asm__ volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+int serial_init(uint16_t base, unsigned baud) {
+    unsigned divisor;
+
+    // an absent UART reads back all ones
+    outb(base + UART_SCR, 0x5A);
+    if (inb(base + UART_SCR) != 0x5A) {
+        return -1;
+    }
+
+    divisor = (baud && (baud <= UART_CLOCK)) ? (UART_CLOCK / baud) : 1;
+    outb(base + UART_IER, 0);
+    outb(base + UART_LCR, LCR_DLAB);
+    outb(base + UART_DLL, divisor & 0xFF);
+    outb(base + UART_DLM, divisor >> 8);
+    outb(base + UART_LCR, LCR_8N1);
+    // enable and clear the fifos, then see if they took
+    outb(base + UART_FCR, 0x07);
+    fifo_size = ((inb(base + UART_IIR) & 0xC0) == 0xC0) ? 16 : 1;
+    // DTR, RTS, OUT2
+    outb(base + UART_MCR, 0x0B);
+
+    uart = base;
+    head = tail = 0;
+    return 0;
+}
+
+// Hand the UART up to a fifo's worth of characters, if it has
+// room for them.  Returns 0 if it was busy.
+int serial_kick(void) {
+    unsigned n;
+
+    if ((uart == 0) || !(inb(uart + UART_LSR) & LSR_THRE)) {
+        return 0;
+    }
+    for (n = 0; (n < fifo_size) && (tail != head); n++) {
+        outb(uart + UART_THR, ring[tail]);
+        tail = (tail + 1) & (RING_SIZE - 1);
+    }
+    return 1;
+}
+
+static void serial_put(char c) {
+    // full: wait for the UART to make room
+    while (((head + 1) & (RING_SIZE - 1)) == tail) {
+        serial_kick();
+    }
+    ring[head] = c;
+    head = (head + 1) & (RING_SIZE - 1);
+}
+
+void serial_write(const char* str, size_t len) {
+    if (uart == 0) {
+        return;
+    }
+    while (len-- > 0) {
+        if (*str == '\n') {
+            serial_put('\r');
+        }
+        serial_put(*str++);
+    }
+    serial_kick();
+}
+
+void serial_flush(void) {
+    if (uart == 0) {
+        return;
+    }
+    while (tail != head) {
+        serial_kick();
+    }
+}
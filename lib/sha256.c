@@ -0,0 +1,443 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <mp.h>
+#include <sha256.h>
+#include <string.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_be32(uint8_t* p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(e, f, g) (((e) & (f)) ^ (~(e) & (g)))
+#define MAJ(a, b, c) (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+#define S0(a) (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+#define S1(e) (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+#define s0(w) (ROR(w, 7) ^ ROR(w, 18) ^ ((w) >> 3))
+#define s1(w) (ROR(w, 17) ^ ROR(w, 19) ^ ((w) >> 10))
+
+// The 64 rounds over a block, for a scalar or vector type T,
+// with W(j) giving message word j (for j < 16).
+#define SHA256_ROUNDS(T, h, W)                                         \
+    do {                                                               \
+        T a = h[0], b = h[1], c = h[2], d = h[3];                      \
+        T e = h[4], f = h[5], g = h[6], hh = h[7];                     \
+        T w[16], t1, t2;                                               \
+        int j;                                                         \
+        for (j = 0; j < 64; j++) {                                     \
+            if (j < 16) {                                              \
+                w[j] = W(j);                                           \
+            } else {                                                   \
+                w[j & 15] += s1(w[(j - 2) & 15]) + w[(j - 7) & 15] +   \
+                             s0(w[(j - 15) & 15]);                     \
+            }                                                          \
+            t1 = hh + S1(e) + CH(e, f, g) + K[j] + w[j & 15];          \
+            t2 = S0(a) + MAJ(a, b, c);                                 \
+            hh = g;                                                    \
+            g = f;                                                     \
+            f = e;                                                     \
+            e = d + t1;                                                \
+            d = c;                                                     \
+            c = b;                                                     \
+            b = a;                                                     \
+            a = t1 + t2;                                               \
+        }                                                              \
+        h[0] += a;                                                     \
+        h[1] += b;                                                     \
+        h[2] += c;                                                     \
+        h[3] += d;                                                     \
+        h[4] += e;                                                     \
+        h[5] += f;                                                     \
+        h[6] += g;                                                     \
+        h[7] += hh;                                                    \
+    } while (0)
+
+static void blocks_generic(uint32_t h[8], const uint8_t* p, size_t n) {
+#define W_GENERIC(j) be32(p + 4 * (j))
+    for (; n > 0; n--, p += SHA256_BLOCK_SIZE) {
+        SHA256_ROUNDS(uint32_t, h, W_GENERIC);
+    }
+#undef W_GENERIC
+}
+
+// SHA extensions: four rounds per pair of sha256rnds2, with the
+// state held as ABEF/CDGH and the schedule in four registers.
+typedef int v4si __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef v4si v4siu __attribute__((aligned(1), may_alias));
+typedef v16qi v16qiu __attribute__((aligned(1), may_alias));
+
+#define ALIGNR(a, b, n) ((v4si)__builtin_ia32_palignr128((v2di)(a), (v2di)(b), (n) * 8))
+#define BLEND(a, b, m) ((v4si)__builtin_ia32_pblendw128((v8hi)(a), (v8hi)(b), (m)))
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void blocks_shani(uint32_t h[8], const uint8_t* p, size_t n) {
+    const v16qi bswap = { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+    v4si state0, state1, abef, cdgh, msg, tmp;
+    v4si m[4];
+    int i;
+
+    tmp = __builtin_ia32_pshufd(*(v4siu*)h, 0xB1);         // CDAB
+    state1 = __builtin_ia32_pshufd(*(v4siu*)(h + 4), 0x1B); // EFGH
+    state0 = ALIGNR(tmp, state1, 8);                       // ABEF
+    state1 = BLEND(state1, tmp, 0xF0);                     // CDGH
+
+    for (; n > 0; n--, p += SHA256_BLOCK_SIZE) {
+        abef = state0;
+        cdgh = state1;
+        for (i = 0; i < 16; i++) {
+            if (i < 4) {
+                m[i] = (v4si)__builtin_ia32_pshufb128(*(v16qiu*)(p + 16 * i), bswap);
+            }
+            msg = m[i & 3] + *(v4siu*)(K + 4 * i);
+            state1 = __builtin_ia32_sha256rnds2(state1, state0, msg);
+            if ((i >= 3) && (i <= 14)) {
+                tmp = ALIGNR(m[i & 3], m[(i - 1) & 3], 4);
+                m[(i + 1) & 3] = __builtin_ia32_sha256msg2(m[(i + 1) & 3] + tmp, m[i & 3]);
+            }
+            msg = __builtin_ia32_pshufd(msg, 0x0E);
+            state0 = __builtin_ia32_sha256rnds2(state0, state1, msg);
+            if ((i >= 1) && (i <= 12)) {
+                m[(i - 1) & 3] = __builtin_ia32_sha256msg1(m[(i - 1) & 3], m[i & 3]);
+            }
+        }
+        state0 += abef;
+        state1 += cdgh;
+    }
+
+    tmp = __builtin_ia32_pshufd(state0, 0x1B);    // FEBA
+    state1 = __builtin_ia32_pshufd(state1, 0xB1); // DCHG
+    *(v4siu*)h = BLEND(tmp, state1, 0xF0);        // DCBA
+    *(v4siu*)(h + 4) = ALIGNR(state1, tmp, 8);    // HGFE
+}
+
+// AVX2: eight independent messages, one per 32 bit lane.
+typedef uint32_t v8u __attribute__((vector_size(32)));
+
+__attribute__((target("avx2")))
+static void blocks_x8(v8u h[8], const uint8_t* const p[8], size_t off) {
+#define W_X8(j)                                                     \
+    ((v8u){ be32(p[0] + off + 4 * (j)), be32(p[1] + off + 4 * (j)), \
+            be32(p[2] + off + 4 * (j)), be32(p[3] + off + 4 * (j)), \
+            be32(p[4] + off + 4 * (j)), be32(p[5] + off + 4 * (j)), \
+            be32(p[6] + off + 4 * (j)), be32(p[7] + off + 4 * (j)) })
+    SHA256_ROUNDS(v8u, h, W_X8);
+#undef W_X8
+}
+
+// Hash eight messages of len bytes each.
+__attribute__((target("avx2")))
+static void sha256_x8(const uint8_t* const data[8], size_t len, uint8_t (*out)[SHA256_DIGEST_SIZE]) {
+    uint8_t tail[8][2 * SHA256_BLOCK_SIZE];
+    const uint8_t* tp[8];
+    size_t off, rem, tlen;
+    v8u h[8];
+    int i, j;
+
+    for (j = 0; j < 8; j++) {
+        h[j] = (v8u){ H0[j], H0[j], H0[j], H0[j], H0[j], H0[j], H0[j], H0[j] };
+    }
+    for (off = 0; (off + SHA256_BLOCK_SIZE) <= len; off += SHA256_BLOCK_SIZE) {
+        blocks_x8(h, data, off);
+    }
+
+    // the same padding for every lane, after its own last bytes
+    rem = len - off;
+    tlen = (rem < 56) ? SHA256_BLOCK_SIZE : (2 * SHA256_BLOCK_SIZE);
+    for (i = 0; i < 8; i++) {
+        memset(tail[i], 0, tlen);
+        memcpy(tail[i], data[i] + off, rem);
+        tail[i][rem] = 0x80;
+        put_be32(tail[i] + tlen - 8, (uint64_t)len >> 29);
+        put_be32(tail[i] + tlen - 4, len << 3);
+        tp[i] = tail[i];
+    }
+    for (off = 0; off < tlen; off += SHA256_BLOCK_SIZE) {
+        blocks_x8(h, tp, off);
+    }
+
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            put_be32(out[i] + 4 * j, h[j][i]);
+        }
+    }
+}
+
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+// Checked on the CPU that will run the code, since an AP may not
+// have had AVX state enabled by the firmware.
+static int avx2_usable(void) {
+    uint32_t a, b, c, d, lo, hi;
+
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a < 7) {
+        return 0;
+    }
+    cpuid(1, 0, &a, &b, &c, &d);
+    // OSXSAVE and AVX
+    if ((c & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28))) {
+        return 0;
+    }
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    if ((lo & 6) != 6) {
+        return 0;
+    }
+    cpuid(7, 0, &a, &b, &c, &d);
+    return (b >> 5) & 1;
+}
+
+static int shani_usable(void) {
+    uint32_t a, b, c, d;
+
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a < 7) {
+        return 0;
+    }
+    cpuid(1, 0, &a, &b, &c, &d);
+    // SSSE3 and SSE4.1
+    if ((c & ((1 << 9) | (1 << 19))) != ((1 << 9) | (1 << 19))) {
+        return 0;
+    }
+    cpuid(7, 0, &a, &b, &c, &d);
+    return (b >> 29) & 1;
+}
+
+static int engine = -1;
+
+int sha256_engine(void) {
+    if (engine < 0) {
+        engine = shani_usable() ? SHA256_SHANI : avx2_usable() ? SHA256_AVX2 : SHA256_GENERIC;
+    }
+    return engine;
+}
+
+const char* sha256_engine_name(void) {
+    static const char* names[] = { "generic", "avx2", "sha-ni" };
+    return names[sha256_engine()];
+}
+
+void sha256_set_engine(int e) {
+    if (e < sha256_engine()) {
+        engine = e;
+    }
+}
+
+static void blocks(uint32_t h[8], const uint8_t* p, size_t n) {
+    if (sha256_engine() == SHA256_SHANI) {
+        blocks_shani(h, p, n);
+    } else {
+        blocks_generic(h, p, n);
+    }
+}
+
+void sha256_init(sha256_ctx* ctx) {
+    memcpy(ctx->h, H0, sizeof(H0));
+    ctx->count = 0;
+}
+
+void sha256_update(sha256_ctx* ctx, const void* _data, size_t len) {
+    const uint8_t* data = _data;
+    size_t used = ctx->count % SHA256_BLOCK_SIZE;
+    size_t n;
+
+    ctx->count += len;
+    if (used) {
+        n = SHA256_BLOCK_SIZE - used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->buf + used, data, n);
+        data += n;
+        len -= n;
+        if ((used + n) < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        blocks(ctx->h, ctx->buf, 1);
+    }
+    n = len / SHA256_BLOCK_SIZE;
+    if (n) {
+        blocks(ctx->h, data, n);
+        data += n * SHA256_BLOCK_SIZE;
+        len -= n * SHA256_BLOCK_SIZE;
+    }
+    memcpy(ctx->buf, data, len);
+}
+
+void sha256_final(sha256_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t pad[2 * SHA256_BLOCK_SIZE];
+    size_t used = ctx->count % SHA256_BLOCK_SIZE;
+    size_t n = (used < 56) ? (56 - used) : (120 - used);
+    uint64_t bits = ctx->count << 3;
+    int i;
+
+    memset(pad, 0, n);
+    pad[0] = 0x80;
+    put_be32(pad + n, bits >> 32);
+    put_be32(pad + n + 4, bits);
+    sha256_update(ctx, pad, n + 8);
+    for (i = 0; i < 8; i++) {
+        put_be32(digest + 4 * i, ctx->h[i]);
+    }
+}
+
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+void sha256c_init(sha256c_ctx* ctx) {
+    sha256_init(&ctx->outer);
+    sha256_init(&ctx->chunk);
+    ctx->chunk_len = 0;
+}
+
+void sha256c_update(sha256c_ctx* ctx, const void* _data, size_t len) {
+    const uint8_t* data = _data;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    size_t n;
+
+    while (len > 0) {
+        n = SHA256C_CHUNK - ctx->chunk_len;
+        if (n > len) {
+            n = len;
+        }
+        sha256_update(&ctx->chunk, data, n);
+        ctx->chunk_len += n;
+        data += n;
+        len -= n;
+        if (ctx->chunk_len == SHA256C_CHUNK) {
+            sha256_final(&ctx->chunk, digest);
+            sha256_update(&ctx->outer, digest, sizeof(digest));
+            sha256_init(&ctx->chunk);
+            ctx->chunk_len = 0;
+        }
+    }
+}
+
+void sha256c_final(sha256c_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t last[SHA256_DIGEST_SIZE];
+
+    if (ctx->chunk_len) {
+        sha256_final(&ctx->chunk, last);
+        sha256_update(&ctx->outer, last, sizeof(last));
+    }
+    sha256_final(&ctx->outer, digest);
+}
+
+// chunks per unit of work: enough to fill the AVX2 lanes
+#define CHUNK_GROUP 8
+
+typedef struct {
+    const uint8_t* data;
+    size_t len;
+    size_t first;
+    size_t last;
+    uint8_t (*digests)[SHA256_DIGEST_SIZE];
+} chunk_job;
+
+static void chunk_job_run(void* arg, size_t index) {
+    chunk_job* job = arg;
+    size_t i = job->first + index * CHUNK_GROUP;
+    size_t end = i + CHUNK_GROUP;
+    const uint8_t* p[CHUNK_GROUP];
+    size_t n;
+    int j;
+
+    if (end > job->last) {
+        end = job->last;
+    }
+    if ((sha256_engine() == SHA256_AVX2) && ((end - i) == CHUNK_GROUP) &&
+        ((end * SHA256C_CHUNK) <= job->len) && avx2_usable()) {
+        for (j = 0; j < CHUNK_GROUP; j++) {
+            p[j] = job->data + (i + j) * SHA256C_CHUNK;
+        }
+        sha256_x8(p, SHA256C_CHUNK, job->digests + i);
+        return;
+    }
+    for (; i < end; i++) {
+        n = job->len - (i * SHA256C_CHUNK);
+        if (n > SHA256C_CHUNK) {
+            n = SHA256C_CHUNK;
+        }
+        sha256(job->data + i * SHA256C_CHUNK, n, job->digests[i]);
+    }
+}
+
+void sha256c_chunks(const void* data, size_t len, size_t first, size_t last,
+                    uint8_t (*digests)[SHA256_DIGEST_SIZE]) {
+    chunk_job job;
+
+    if (first >= last) {
+        return;
+    }
+    sha256_engine();
+    job.data = data;
+    job.len = len;
+    job.first = first;
+    job.last = last;
+    job.digests = digests;
+    mp_run(chunk_job_run, &job, (last - first + CHUNK_GROUP - 1) / CHUNK_GROUP);
+}
+
+// chunk digests computed per pass over a whole buffer
+#define CHUNKS_PER_PASS 128
+
+void sha256c(const void* _data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t digests[CHUNKS_PER_PASS][SHA256_DIGEST_SIZE];
+    const uint8_t* data = _data;
+    size_t count = (len + SHA256C_CHUNK - 1) / SHA256C_CHUNK;
+    size_t i, n;
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    for (i = 0; i < count; i += n) {
+        n = count - i;
+        if (n > CHUNKS_PER_PASS) {
+            n = CHUNKS_PER_PASS;
+        }
+        sha256c_chunks(data + i * SHA256C_CHUNK, len - i * SHA256C_CHUNK, 0, n, digests);
+        sha256_update(&ctx, digests, n * SHA256_DIGEST_SIZE);
+    }
+    sha256_final(&ctx, digest);
+}
@@ -14,26 +14,185 @@
 
 #include <string.h>
 
+// Copies and fills pick a strategy by size: overlapping scalar
+// moves for small sizes, 16 byte SSE2 moves with aligned stores
+// for medium sizes, and rep movsb/stosb, which modern CPUs run
+// at full cache line width, for large ones.
+#define REP_THRESHOLD 2048
+
+typedef uint64_t u64u __attribute__((aligned(1), may_alias));
+typedef uint32_t u32u __attribute__((aligned(1), may_alias));
+typedef uint16_t u16u __attribute__((aligned(1), may_alias));
+typedef char v16 __attribute__((vector_size(16)));
+typedef char v16u __attribute__((vector_size(16), aligned(1), may_alias));
+
+static inline void copy_small(uint8_t* dst, const uint8_t* src, size_t n) {
+    // all loads happen before the stores, so this is overlap safe
+    if (n >= 8) {
+        uint64_t a = *(u64u*)src, b = *(u64u*)(src + n - 8);
+        *(u64u*)dst = a;
+        *(u64u*)(dst + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(u32u*)src, b = *(u32u*)(src + n - 4);
+        *(u32u*)dst = a;
+        *(u32u*)(dst + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(u16u*)src, b = *(u16u*)(src + n - 2);
+        *(u16u*)dst = a;
+        *(u16u*)(dst + n - 2) = b;
+    } else if (n) {
+        *dst = *src;
+    }
+}
+
+void* memcpy(void* _dst, const void* _src, size_t n) {
+    uint8_t* dst = _dst;
+    const uint8_t* src = _src;
+    v16 head, tail;
+    size_t skip;
+
+    if (n < 16) {
+        copy_small(dst, src, n);
+        return _dst;
+    }
+    if (n >= REP_THRESHOLD) {
+        __asm__ volatile("rep movsb"
+                         : "+D"(dst), "+S"(src), "+c"(n)
+                         :
+                         : "memory");
+        return _dst;
+    }
+    // unaligned first and last 16 bytes, aligned stores between
+    head = *(v16u*)src;
+    tail = *(v16u*)(src + n - 16);
+    skip = 16 - ((uintptr_t)dst & 15);
+    *(v16u*)(dst + n - 16) = tail;
+    *(v16u*)dst = head;
+    dst += skip;
+    src += skip;
+    n -= skip;
+    while (n > 64) {
+        v16 a = *(v16u*)src, b = *(v16u*)(src + 16);
+        v16 c = *(v16u*)(src + 32), d = *(v16u*)(src + 48);
+        *(v16*)dst = a;
+        *(v16*)(dst + 16) = b;
+        *(v16*)(dst + 32) = c;
+        *(v16*)(dst + 48) = d;
+        dst += 64;
+        src += 64;
+        n -= 64;
+    }
+    while (n > 16) {
+        *(v16*)dst = *(v16u*)src;
+        dst += 16;
+        src += 16;
+        n -= 16;
+    }
+    return _dst;
+}
+
 void* memset(void* _dst, int c, size_t n) {
     uint8_t* dst = _dst;
-    while (n-- > 0) {
-        *dst++ = c;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
+    v16 fill;
+    size_t skip;
+
+    if (n < 16) {
+        if (n >= 8) {
+            *(u64u*)dst = pattern;
+            *(u64u*)(dst + n - 8) = pattern;
+        } else if (n >= 4) {
+            *(u32u*)dst = pattern;
+            *(u32u*)(dst + n - 4) = pattern;
+        } else {
+            while (n-- > 0) {
+                *dst++ = c;
+            }
+        }
+        return _dst;
+    }
+    if (n >= REP_THRESHOLD) {
+        __asm__ volatile("rep stosb"
+                         : "+D"(dst), "+c"(n)
+                         : "a"(c)
+                         : "memory");
+        return _dst;
+    }
+    fill = (v16){ c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+    skip = 16 - ((uintptr_t)dst & 15);
+    *(v16u*)dst = fill;
+    *(v16u*)(dst + n - 16) = fill;
+    dst += skip;
+    n -= skip;
+    while (n > 64) {
+        *(v16*)dst = fill;
+        *(v16*)(dst + 16) = fill;
+        *(v16*)(dst + 32) = fill;
+        *(v16*)(dst + 48) = fill;
+        dst += 64;
+        n -= 64;
+    }
+    while (n > 16) {
+        *(v16*)dst = fill;
+        dst += 16;
+        n -= 16;
     }
     return _dst;
 }
 
-void* memcpy(void* _dst, const void* _src, size_t n) {
+void* memmove(void* _dst, const void* _src, size_t n) {
     uint8_t* dst = _dst;
     const uint8_t* src = _src;
-    while (n-- > 0) {
-        *dst++ = *src++;
+    v16 x, y;
+
+    if (((dst + n) <= src) || ((src + n) <= dst)) {
+        return memcpy(_dst, _src, n);
+    }
+    // each block is loaded before the store that could clobber
+    // it, so moving in the right direction is overlap safe
+    if (dst < src) {
+        while (n >= 32) {
+            x = *(v16u*)src;
+            y = *(v16u*)(src + 16);
+            *(v16u*)dst = x;
+            *(v16u*)(dst + 16) = y;
+            dst += 32;
+            src += 32;
+            n -= 32;
+        }
+        if (n >= 16) {
+            x = *(v16u*)src;
+            *(v16u*)dst = x;
+            dst += 16;
+            src += 16;
+            n -= 16;
+        }
+        copy_small(dst, src, n);
+        return _dst;
+    }
+    dst += n;
+    src += n;
+    while (n >= 32) {
+        x = *(v16u*)(src - 16);
+        y = *(v16u*)(src - 32);
+        *(v16u*)(dst - 16) = x;
+        *(v16u*)(dst - 32) = y;
+        dst -= 32;
+        src -= 32;
+        n -= 32;
     }
+    if (n >= 16) {
+        x = *(v16u*)(src - 16);
+        *(v16u*)(dst - 16) = x;
+        dst -= 16;
+        src -= 16;
+        n -= 16;
+    }
+    copy_small(dst - n, src - n, n);
     return _dst;
 }
 
-int memcmp(const void* _a, const void* _b, size_t n) {
-    const uint8_t* a = _a;
-    const uint8_t* b = _b;
+static inline int cmp_bytes(const uint8_t* a, const uint8_t* b, size_t n) {
     while (n-- > 0) {
         int x = *a++ - *b++;
         if (x != 0) {
@@ -43,9 +202,65 @@ int memcmp(const void* _a, const void* _b, size_t n) {
     return 0;
 }
 
+int memcmp(const void* _a, const void* _b, size_t n) {
+    const uint8_t* a = _a;
+    const uint8_t* b = _b;
+    unsigned mask;
+
+    // find the first differing block, then the byte
+    while (n >= 64) {
+        v16 eq = (*(v16u*)a == *(v16u*)b) & (*(v16u*)(a + 16) == *(v16u*)(b + 16)) &
+                 (*(v16u*)(a + 32) == *(v16u*)(b + 32)) & (*(v16u*)(a + 48) == *(v16u*)(b + 48));
+        if (__builtin_ia32_pmovmskb128(eq) != 0xFFFF) {
+            break;
+        }
+        a += 64;
+        b += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        mask = __builtin_ia32_pmovmskb128(*(v16u*)a == *(v16u*)b);
+        if (mask != 0xFFFF) {
+            n = __builtin_ctz(~mask);
+            return a[n] - b[n];
+        }
+        a += 16;
+        b += 16;
+        n -= 16;
+    }
+    while (n >= 8) {
+        if (*(u64u*)a != *(u64u*)b) {
+            return cmp_bytes(a, b, 8);
+        }
+        a += 8;
+        b += 8;
+        n -= 8;
+    }
+    return cmp_bytes(a, b, n);
+}
+
 size_t strlen(const char* s) {
     size_t len = 0;
     while (*s++)
         len++;
     return len;
 }
+
+int strcmp(const char* a, const char* b) {
+    while (*a && (*a == *b)) {
+        a++;
+        b++;
+    }
+    return *(const uint8_t*)a - *(const uint8_t*)b;
+}
+
+int strncmp(const char* a, const char* b, size_t n) {
+    while (n-- > 0) {
+        if ((*a != *b) || (*a == 0)) {
+            return *(const uint8_t*)a - *(const uint8_t*)b;
+        }
+        a++;
+        b++;
+    }
+    return 0;
+}
@@ -0,0 +1,276 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <efi.h>
+#include <efilib.h>
+#include <efigpt.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <goodies.h>
+
+#include <bootpart.h>
+
+static EFI_GUID BootPartTypeGUID = BOOTPART_TYPE_GUID;
+
+// largest single ReadBlocks() request
+#define MAX_XFER (8 * 1024 * 1024)
+
+static EFI_BLOCK_IO* bio;
+static uint64_t part_start; // in bytes, from the start of the disk
+static uint64_t part_size;
+static bootpart_hdr hdr;
+
+// one block (or page, if larger), for partial blocks
+static uint8_t* bounce;
+static UINTN bounce_pages;
+
+static EFI_STATUS read_blocks(uint64_t lba, void* data, UINTN len) {
+    return bio->ReadBlocks(bio, bio->Media->MediaId, lba, len, data);
+}
+
+// Read len bytes at byte offset pos on the disk.  Whole, suitably
+// aligned blocks go straight to the destination.
+static int read_bytes(uint64_t pos, void* _data, size_t len) {
+    uint8_t* data = _data;
+    uint32_t bsz = bio->Media->BlockSize;
+    uint32_t align = bio->Media->IoAlign;
+    size_t skip, n;
+
+    while (len > 0) {
+        if (ReadIdle()) {
+            return -1;
+        }
+        skip = pos % bsz;
+        if ((skip == 0) && (len >= bsz) &&
+            ((align <= 1) || (((uintptr_t)data % align) == 0))) {
+            n = len - (len % bsz);
+            if (n > MAX_XFER) {
+                n = MAX_XFER;
+            }
+            if (read_blocks(pos / bsz, data, n)) {
+                printf("bootpart: read error at %lx\n", pos);
+                return -1;
+            }
+        } else {
+            if (read_blocks(pos / bsz, bounce, bsz)) {
+                printf("bootpart: read error at %lx\n", pos);
+                return -1;
+            }
+            n = bsz - skip;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(data, bounce + skip, n);
+        }
+        data += n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int find_partition(EFI_BLOCK_IO* b) {
+    EFI_PARTITION_TABLE_HEADER* gpt;
+    EFI_PARTITION_ENTRY* entry;
+    EFI_PHYSICAL_ADDRESS mem;
+    uint32_t bsz = b->Media->BlockSize;
+    uint32_t crc, hcrc, tcrc, count, esz;
+    uint64_t lba;
+    UINTN pages, i;
+    size_t len;
+    uint8_t* table;
+    int r = -1;
+
+    bio = b;
+    bounce_pages = EFI_SIZE_TO_PAGES(bsz);
+    if (gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, bounce_pages, &mem)) {
+        return -1;
+    }
+    bounce = (void*)mem;
+
+    if (read_blocks(PRIMARY_PART_HEADER_LBA, bounce, bsz)) {
+        goto done;
+    }
+    gpt = (void*)bounce;
+    if (memcmp(&gpt->Header.Signature, EFI_PTAB_HEADER_ID, 8) ||
+        (gpt->Header.HeaderSize < sizeof(EFI_PARTITION_TABLE_HEADER)) ||
+        (gpt->Header.HeaderSize > bsz) ||
+        (gpt->SizeOfPartitionEntry < sizeof(EFI_PARTITION_ENTRY)) ||
+        (gpt->NumberOfPartitionEntries > 1024)) {
+        goto done;
+    }
+    // the header's CRC is taken with its own CRC field zeroed
+    hcrc = gpt->Header.CRC32;
+    gpt->Header.CRC32 = 0;
+    if (gBS->CalculateCrc32(gpt, gpt->Header.HeaderSize, &crc) || (crc != hcrc)) {
+        printf("bootpart: bad partition table header CRC\n");
+        goto done;
+    }
+
+    // bounce is reused by read_bytes(), so take what is needed now
+    lba = gpt->PartitionEntryLBA;
+    count = gpt->NumberOfPartitionEntries;
+    esz = gpt->SizeOfPartitionEntry;
+    tcrc = gpt->PartitionEntryArrayCRC32;
+
+    len = count * esz;
+    pages = EFI_SIZE_TO_PAGES(len);
+    if (gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &mem)) {
+        goto done;
+    }
+    table = (void*)mem;
+    if (read_bytes(lba * bsz, table, len) == 0) {
+        if (gBS->CalculateCrc32(table, len, &crc) || (crc != tcrc)) {
+            printf("bootpart: bad partition table CRC\n");
+            count = 0;
+        }
+        for (i = 0; i < count; i++) {
+            entry = (void*)(table + i * esz);
+            if (CompareGuid(&entry->PartitionTypeGUID, &BootPartTypeGUID)) {
+                continue;
+            }
+            part_start = entry->StartingLBA * bsz;
+            part_size = (entry->EndingLBA - entry->StartingLBA + 1) * bsz;
+            r = 0;
+            break;
+        }
+    }
+    gBS->FreePages(mem, pages);
+
+done:
+    if (r) {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)bounce, bounce_pages);
+        bounce = NULL;
+        bio = NULL;
+    }
+    return r;
+}
+
+static int check_header(void) {
+    bootpart_extent* e;
+    unsigned i;
+
+    if (read_bytes(part_start, &hdr, sizeof(hdr))) {
+        return -1;
+    }
+    if ((hdr.magic != BOOTPART_MAGIC) || (hdr.version != BOOTPART_VERSION) ||
+        (hdr.count > BOOTPART_MAX_EXTENTS)) {
+        printf("bootpart: invalid header\n");
+        return -1;
+    }
+    for (i = 0; i < hdr.count; i++) {
+        e = hdr.extent + i;
+        if ((e->offset > part_size) || (e->size > (part_size - e->offset))) {
+            printf("bootpart: extent %d out of bounds\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bootpart_open(void) {
+    EFI_HANDLE* list;
+    EFI_BLOCK_IO* b;
+    UINTN count, i;
+
+    if (bio) {
+        return 0;
+    }
+    if (gBS->LocateHandleBuffer(ByProtocol, &BlockIoProtocol, NULL, &count, &list)) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (OpenProtocol(list[i], &BlockIoProtocol, (void**)&b)) {
+            continue;
+        }
+        // we want whole disks, which hold the partition table
+        if (!b->Media->MediaPresent || b->Media->LogicalPartition) {
+            continue;
+        }
+        if (find_partition(b)) {
+            continue;
+        }
+        if (check_header() == 0) {
+            printf("bootpart: found boot image partition (%ld MB)\n",
+                   part_size / (1024 * 1024));
+            break;
+        }
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)bounce, bounce_pages);
+        bounce = NULL;
+        bio = NULL;
+    }
+    gBS->FreePool(list);
+    return bio ? 0 : -1;
+}
+
+static bootpart_extent* find_extent(const char* name) {
+    char tmp[BOOTPART_NAME_LEN];
+    size_t len = strlen(name);
+    unsigned i;
+
+    if (len >= BOOTPART_NAME_LEN) {
+        return NULL;
+    }
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp, name, len);
+    for (i = 0; i < hdr.count; i++) {
+        if (!memcmp(hdr.extent[i].name, tmp, sizeof(tmp))) {
+            return hdr.extent + i;
+        }
+    }
+    return NULL;
+}
+
+int bootpart_find(const char* name, uint64_t* size) {
+    bootpart_extent* e;
+
+    if ((bio == NULL) || ((e = find_extent(name)) == NULL)) {
+        return -1;
+    }
+    *size = e->size;
+    return 0;
+}
+
+int bootpart_read(const char* name, uint64_t off, void* data, size_t len) {
+    bootpart_extent* e;
+
+    if ((bio == NULL) || ((e = find_extent(name)) == NULL)) {
+        return -1;
+    }
+    if ((off > e->size) || (len > (e->size - off))) {
+        return -1;
+    }
+    return read_bytes(part_start + e->offset + off, data, len);
+}
+
+void* bootpart_load(const char* name, size_t* size) {
+    EFI_PHYSICAL_ADDRESS mem;
+    uint64_t sz;
+
+    if (bootpart_find(name, &sz) || (sz == 0)) {
+        return NULL;
+    }
+    mem = 0xFFFFFFFF;
+    if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(sz), &mem)) {
+        printf("bootpart: cannot allocate %ld bytes\n", sz);
+        return NULL;
+    }
+    if (bootpart_read(name, 0, (void*)mem, sz)) {
+        gBS->FreePages(mem, EFI_SIZE_TO_PAGES(sz));
+        return NULL;
+    }
+    *size = sz;
+    return (void*)mem;
+}
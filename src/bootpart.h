@@ -0,0 +1,60 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+// A boot image partition is a raw GPT partition of type
+// BOOTPART_TYPE_GUID holding a header followed by the contents
+// of kernel.bin, ramdisk.bin, and cmdline.  osboot reads it
+// with BlockIo in large transfers, bypassing the FAT driver.
+//
+// Extents start on BOOTPART_ALIGN boundaries, except that the
+// kernel is placed so its image (past the setup sectors) does.
+
+#define BOOTPART_TYPE_GUID_STR "55bfcddd-e8e6-4e14-a21a-fca97558a79a"
+#define BOOTPART_TYPE_GUID \
+    { 0x55bfcddd, 0xe8e6, 0x4e14, {0xa2, 0x1a, 0xfc, 0xa9, 0x75, 0x58, 0xa7, 0x9a} }
+
+#define BOOTPART_MAGIC 0x54524150544f4f42ULL // "BOOTPART"
+#define BOOTPART_VERSION 1
+
+#define BOOTPART_MAX_EXTENTS 8
+#define BOOTPART_NAME_LEN 16
+#define BOOTPART_HDR_SIZE 4096
+#define BOOTPART_ALIGN (64 * 1024)
+
+typedef struct bootpart_extent_t {
+    char name[BOOTPART_NAME_LEN];
+    uint64_t offset; // bytes from the start of the partition
+    uint64_t size;
+} bootpart_extent;
+
+typedef struct bootpart_hdr_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t count;
+    bootpart_extent extent[BOOTPART_MAX_EXTENTS];
+} bootpart_hdr;
+
+// Locate the boot image partition.  Returns 0 if found.
+int bootpart_open(void);
+
+// Find the named extent, returning 0 and its size if present.
+int bootpart_find(const char* name, uint64_t* size);
+
+// Read len bytes at offset off within the named extent.
+int bootpart_read(const char* name, uint64_t off, void* data, size_t len);
+
+// Read the named extent into pages below 4GB.
+void* bootpart_load(const char* name, size_t* size);
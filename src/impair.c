@@ -0,0 +1,270 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "impair.h"
+
+// extra time a reordered frame is held for, past its normal latency
+#define REORDER_US 1000
+
+typedef struct frame_t frame;
+struct frame_t {
+    frame* next;
+    uint64_t due;
+    size_t len;
+    uint8_t data[0];
+};
+
+struct impair {
+    impair_cfg cfg;
+    uint64_t rng;
+    uint64_t link_free; // when the cap lets the next frame start
+    frame* head;        // queued frames, in order of arrival
+    frame* tail;
+    uint32_t count;
+    impair_stats stats;
+    void (*deliver)(void* cookie, const void* frame, size_t len);
+    void* cookie;
+};
+
+// xorshift64*: cheap, and the same sequence everywhere
+static uint64_t impair_rand(impair* link) {
+    link->rng ^= link->rng >> 12;
+    link->rng ^= link->rng << 25;
+    link->rng ^= link->rng >> 27;
+    return link->rng * 2685821657736338717ULL;
+}
+
+// a percentage, in [0, 100)
+static double impair_chance(impair* link) {
+    return (impair_rand(link) >> 11) * (100.0 / 9007199254740992.0);
+}
+
+static int impair_queue(impair* link, const void* data, size_t len, uint64_t due) {
+    frame* f;
+    frame** p;
+
+    if ((f = malloc(sizeof(frame) + len)) == NULL) {
+        return -1;
+    }
+    f->due = due;
+    f->len = len;
+    memcpy(f->data, data, len);
+
+    // almost always the latest, but reordering and jitter aside
+    if ((link->tail == NULL) || (link->tail->due <= due)) {
+        p = link->tail ? &link->tail->next : &link->head;
+    } else {
+        for (p = &link->head; (*p)->due <= due; p = &(*p)->next)
+            ;
+    }
+    f->next = *p;
+    *p = f;
+    if (f->next == NULL) {
+        link->tail = f;
+    }
+    link->count++;
+    return 0;
+}
+
+impair* impair_create(const impair_cfg* cfg, uint64_t seed,
+                      void (*deliver)(void* cookie, const void* frame, size_t len),
+                      void* cookie) {
+    impair* link;
+
+    if ((link = calloc(1, sizeof(impair))) == NULL) {
+        return NULL;
+    }
+    link->cfg = *cfg;
+    // xorshift must not start at zero
+    link->rng = seed ^ 0x9E3779B97F4A7C15ULL;
+    if (link->rng == 0) {
+        link->rng = 1;
+    }
+    link->deliver = deliver;
+    link->cookie = cookie;
+    return link;
+}
+
+void impair_destroy(impair* link) {
+    frame* f;
+
+    while ((f = link->head) != NULL) {
+        link->head = f->next;
+        free(f);
+    }
+    free(link);
+}
+
+void impair_send(impair* link, const void* data, size_t len, uint64_t now) {
+    impair_cfg* cfg = &link->cfg;
+    double lose, dup, reorder;
+    uint64_t jitter, due;
+
+    // draw for every frame, whatever happens to it, so that one
+    // frame's fate does not shift the next one's
+    lose = impair_chance(link);
+    dup = impair_chance(link);
+    reorder = impair_chance(link);
+    jitter = impair_rand(link);
+
+    link->stats.frames++;
+    if (lose < cfg->loss) {
+        link->stats.dropped++;
+        return;
+    }
+    if (cfg->limit && (link->count >= cfg->limit)) {
+        link->stats.overflowed++;
+        return;
+    }
+
+    // the cap serializes frames; latency starts once one is sent
+    due = now;
+    if (cfg->rate) {
+        if (link->link_free < now) {
+            link->link_free = now;
+        }
+        link->link_free += (len * 1000000ULL) / cfg->rate;
+        due = link->link_free;
+    }
+    due += cfg->delay;
+    if (cfg->jitter) {
+        due += jitter % cfg->jitter;
+    }
+    if (reorder < cfg->reorder) {
+        link->stats.reordered++;
+        due += cfg->jitter + REORDER_US;
+    }
+
+    if (impair_queue(link, data, len, due)) {
+        link->stats.overflowed++;
+        return;
+    }
+    if ((dup < cfg->dup) && (impair_queue(link, data, len, due) == 0)) {
+        link->stats.duplicated++;
+    }
+}
+
+uint64_t impair_poll(impair* link, uint64_t now) {
+    frame* f;
+
+    while ((f = link->head) != NULL) {
+        if (f->due > now) {
+            return f->due;
+        }
+        if ((link->head = f->next) == NULL) {
+            link->tail = NULL;
+        }
+        link->count--;
+        link->deliver(link->cookie, f->data, f->len);
+        free(f);
+    }
+    return 0;
+}
+
+void impair_get_stats(impair* link, impair_stats* stats) {
+    *stats = link->stats;
+}
+
+// Parse a number with an optional unit, scaled by the matching factor.
+static int parse_unit(const char* s, const char* const* units,
+                      const double* scale, double* out) {
+    char* end;
+    double v = strtod(s, &end);
+
+    if ((end == s) || (v < 0)) {
+        return -1;
+    }
+    if (*end == 0) {
+        *out = v * scale[0];
+        return 0;
+    }
+    for (int i = 1; units[i]; i++) {
+        if (!strcasecmp(end, units[i])) {
+            *out = v * scale[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char* const percent_units[] = { "", "%", NULL };
+static const double percent_scale[] = { 1, 1 };
+static const char* const time_units[] = { "", "us", "ms", "s", NULL };
+static const double time_scale[] = { 1000, 1, 1000, 1000000 };
+static const char* const rate_units[] = { "", "bit", "kbit", "mbit", "gbit", NULL };
+static const double rate_scale[] = { 1 / 8.0, 1 / 8.0, 1e3 / 8, 1e6 / 8, 1e9 / 8 };
+
+int impair_parse(impair_cfg* cfg, const char* spec) {
+    char buf[256];
+    char* item;
+    char* next;
+    char* val;
+    char* end;
+    double v;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, spec);
+    for (item = buf; item && *item; item = next) {
+        if ((next = strchr(item, ',')) != NULL) {
+            *next++ = 0;
+        }
+        if ((val = strchr(item, '=')) == NULL) {
+            return -1;
+        }
+        *val++ = 0;
+        if (!strcmp(item, "loss") || !strcmp(item, "dup") || !strcmp(item, "reorder")) {
+            if (parse_unit(val, percent_units, percent_scale, &v) || (v > 100)) {
+                return -1;
+            }
+            if (item[0] == 'l') {
+                cfg->loss = v;
+            } else if (item[0] == 'd') {
+                cfg->dup = v;
+            } else {
+                cfg->reorder = v;
+            }
+        } else if (!strcmp(item, "delay") || !strcmp(item, "jitter")) {
+            // bare times are in milliseconds
+            if (parse_unit(val, time_units, time_scale, &v) || (v > 60e6)) {
+                return -1;
+            }
+            if (item[0] == 'd') {
+                cfg->delay = v;
+            } else {
+                cfg->jitter = v;
+            }
+        } else if (!strcmp(item, "rate")) {
+            // bare rates are in bits per second
+            if (parse_unit(val, rate_units, rate_scale, &v)) {
+                return -1;
+            }
+            cfg->rate = v;
+        } else if (!strcmp(item, "limit")) {
+            unsigned long n = strtoul(val, &end, 10);
+            if ((end == val) || *end || (n > 1000000)) {
+                return -1;
+            }
+            cfg->limit = n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
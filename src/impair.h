@@ -0,0 +1,63 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Impairments for one direction of an emulated link (host tools only).
+// Rates are percentages of frames, times are in microseconds.
+typedef struct {
+    double loss;      // frames dropped
+    double dup;       // frames delivered twice
+    double reorder;   // frames held back so later ones overtake them
+    uint32_t delay;   // one-way latency
+    uint32_t jitter;  // extra latency, uniform in [0, jitter)
+    uint64_t rate;    // bandwidth cap in bytes/s, 0 for none
+    uint32_t limit;   // frames in flight before tail drop
+} impair_cfg;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t overflowed;
+    uint64_t duplicated;
+    uint64_t reordered;
+} impair_stats;
+
+typedef struct impair impair;
+
+// Parse a comma separated list such as
+//   loss=2,dup=0.5,reorder=1,delay=5ms,jitter=1ms,rate=100mbit,limit=64
+// into cfg, leaving fields not named alone.  Returns -1 on error.
+int impair_parse(impair_cfg* cfg, const char* spec);
+
+// Create a link which passes frames to deliver() as they arrive.
+// Each frame consumes the same number of draws from the generator
+// seeded with seed, so a given seed drops, duplicates and reorders
+// the same frames of a given sequence every time.
+impair* impair_create(const impair_cfg* cfg, uint64_t seed,
+                      void (*deliver)(void* cookie, const void* frame, size_t len),
+                      void* cookie);
+void impair_destroy(impair* link);
+
+// Put a frame on the link at time now.
+void impair_send(impair* link, const void* frame, size_t len, uint64_t now);
+
+// Deliver every frame due by now.  Returns when the next one is
+// due, or 0 if the link is idle.
+uint64_t impair_poll(impair* link, uint64_t now);
+
+void impair_get_stats(impair* link, impair_stats* stats);
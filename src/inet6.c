@@ -18,19 +18,64 @@
 
 #include <inet6.h>
 
-#if 1
-#define BAD(n)                    \
-    do {                          \
-        printf("error: %s\n", n); \
-        return;                   \
+// Log level for the receive path:
+// 0 - drops are only counted
+// 1 - counters are summarized periodically by ip6_report_drops()
+// 2 - every dropped packet is also printed (slow, debug only)
+#ifndef IP6_LOG_LEVEL
+#define IP6_LOG_LEVEL 1
+#endif
+
+#if IP6_LOG_LEVEL >= 1
+static const char* ip6_drop_names[IP6_DROP_COUNT] = {
+    [IP6_DROP_BAD_HDR_LEN] = "Bogus Header Len",
+    [IP6_DROP_BAD_VERSION] = "Unknown IP6 Version",
+    [IP6_DROP_BAD_LENGTH] = "IP6 Length Mismatch",
+    [IP6_DROP_BAD_CHECKSUM] = "Checksum Invalid",
+    [IP6_DROP_CHECKSUM] = "Checksum Incorrect",
+    [IP6_DROP_SHORT] = "Packet Too Short",
+    [IP6_DROP_BAD_NDP] = "Bogus NDP Message",
+    [IP6_DROP_NDP_NOT_ME] = "NDP Not For Me",
+    [IP6_DROP_ICMP6_UNHANDLED] = "ICMP6 Unhandled",
+    [IP6_DROP_IP6_UNHANDLED] = "Unhandled IP6",
+};
+
+static uint32_t ip6_drops_reported[IP6_DROP_COUNT];
+#endif
+
+static uint32_t ip6_drops[IP6_DROP_COUNT];
+
+#if IP6_LOG_LEVEL >= 2
+#define BAD(n)                                    \
+    do {                                          \
+        ip6_drops[n]++;                           \
+        printf("error: %s\n", ip6_drop_names[n]); \
+        return;                                   \
     } while (0)
 #else
-#define BAD(n)  \
-    do {        \
-        return; \
+#define BAD(n)          \
+    do {                \
+        ip6_drops[n]++; \
+        return;         \
     } while (0)
 #endif
 
+void ip6_report_drops(void) {
+#if IP6_LOG_LEVEL >= 1
+    uint32_t n;
+    int i;
+    for (i = 0; i < IP6_DROP_COUNT; i++) {
+        n = ip6_drops[i] - ip6_drops_reported[i];
+        if (n == 0) {
+            continue;
+        }
+        ip6_drops_reported[i] = ip6_drops[i];
+        printf("inet6: dropped %u (%u total): %s\n",
+               n, ip6_drops[i], ip6_drop_names[i]);
+    }
+#endif
+}
+
 // useful addresses
 const ip6_addr ip6_ll_all_nodes = {
     .x = {0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
@@ -263,22 +308,22 @@ void _udp6_recv(ip6_hdr* ip, void* _data, size_t len) {
     uint16_t sum, n;
 
     if (len < UDP_HDR_LEN)
-        BAD("Bogus Header Len");
+        BAD(IP6_DROP_BAD_HDR_LEN);
     if (udp->checksum == 0)
-        BAD("Checksum Invalid");
+        BAD(IP6_DROP_BAD_CHECKSUM);
     if (udp->checksum == 0xFFFF)
         udp->checksum = 0;
 
     sum = checksum(&ip->length, 2, htons(HDR_UDP));
     sum = checksum(ip->src, 32 + len, sum);
     if (sum != 0xFFFF)
-        BAD("Checksum Incorrect");
+        BAD(IP6_DROP_CHECKSUM);
 
     n = ntohs(udp->length);
     if (n < UDP_HDR_LEN)
-        BAD("Bogus Header Len");
+        BAD(IP6_DROP_BAD_HDR_LEN);
     if (n > len)
-        BAD("Packet Too Short");
+        BAD(IP6_DROP_SHORT);
     len = n - UDP_HDR_LEN;
 
     udp6_recv((uint8_t*)_data + UDP_HDR_LEN, len,
@@ -291,14 +336,14 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
     uint16_t sum;
 
     if (icmp->checksum == 0)
-        BAD("Checksum Invalid");
+        BAD(IP6_DROP_BAD_CHECKSUM);
     if (icmp->checksum == 0xFFFF)
         icmp->checksum = 0;
 
     sum = checksum(&ip->length, 2, htons(HDR_ICMP6));
     sum = checksum(ip->src, 32 + len, sum);
     if (sum != 0xFFFF)
-        BAD("Checksum Incorrect");
+        BAD(IP6_DROP_CHECKSUM);
 
     if (icmp->type == ICMP6_NDP_N_SOLICIT) {
         ndp_n_hdr* ndp = _data;
@@ -308,11 +353,11 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
         } msg;
 
         if (len < sizeof(ndp_n_hdr))
-            BAD("Bogus NDP Message");
+            BAD(IP6_DROP_BAD_NDP);
         if (ndp->code != 0)
-            BAD("Bogus NDP Code");
+            BAD(IP6_DROP_BAD_NDP);
         if (memcmp(ndp->target, &ll_ip6_addr, IP6_ADDR_LEN))
-            BAD("NDP Not For Me");
+            BAD(IP6_DROP_NDP_NOT_ME);
 
         msg.hdr.type = ICMP6_NDP_N_ADVERTISE;
         msg.hdr.code = 0;
@@ -334,7 +379,7 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
         return;
     }
 
-    BAD("ICMP6 Unhandled");
+    BAD(IP6_DROP_ICMP6_UNHANDLED);
 }
 
 void eth_recv(void* _data, size_t len) {
@@ -343,7 +388,7 @@ void eth_recv(void* _data, size_t len) {
     uint32_t n;
 
     if (len < (ETH_HDR_LEN + IP6_HDR_LEN))
-        BAD("Bogus Header Len");
+        BAD(IP6_DROP_BAD_HDR_LEN);
     if (data[12] != (ETH_IP6 >> 8))
         return;
     if (data[13] != (ETH_IP6 & 0xFF))
@@ -355,19 +400,20 @@ void eth_recv(void* _data, size_t len) {
 
     // require v6
     if ((ip->ver_tc_flow & 0xF0) != 0x60)
-        BAD("Unknown IP6 Version");
+        BAD(IP6_DROP_BAD_VERSION);
 
     // ensure length is sane
     n = ntohs(ip->length);
     if (n > len)
-        BAD("IP6 Length Mismatch");
+        BAD(IP6_DROP_BAD_LENGTH);
 
     // ignore any trailing data in the ethernet frame
     len = n;
 
     // require that we are the destination
     if (memcmp(&ll_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
-        memcmp(&snm_ip6_addr, ip->dst, IP6_ADDR_LEN)) {
+        memcmp(&snm_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
+        memcmp(&ip6_ll_all_nodes, ip->dst, IP6_ADDR_LEN)) {
         return;
     }
 
@@ -385,7 +431,7 @@ void eth_recv(void* _data, size_t len) {
         return;
     }
 
-    BAD("Unhandled IP6");
+    BAD(IP6_DROP_IP6_UNHANDLED);
 }
 
 char* ip6toa(char* _out, void* ip6addr) {
@@ -43,6 +43,9 @@ struct ip6_addr_t {
 extern const ip6_addr ip6_ll_all_nodes;
 extern const ip6_addr ip6_ll_all_routers;
 
+// our own MAC address, once ip6_init() has run
+extern mac_addr ll_mac_addr;
+
 #define ETH_IP4 0x0800
 #define ETH_ARP 0x0806
 #define ETH_IP6 0x86DD
@@ -130,6 +133,24 @@ char* ip6toa(char* _out, void* ip6addr);
 void ip6_init(void* macaddr);
 void eth_recv(void* data, size_t len);
 
+// Reasons for dropping a received packet.  Drops are counted
+// rather than printed; ip6_report_drops() prints the counters
+// that changed since the last call and should be called at a
+// low rate from the poll loop.
+#define IP6_DROP_BAD_HDR_LEN 0
+#define IP6_DROP_BAD_VERSION 1
+#define IP6_DROP_BAD_LENGTH 2
+#define IP6_DROP_BAD_CHECKSUM 3
+#define IP6_DROP_CHECKSUM 4
+#define IP6_DROP_SHORT 5
+#define IP6_DROP_BAD_NDP 6
+#define IP6_DROP_NDP_NOT_ME 7
+#define IP6_DROP_ICMP6_UNHANDLED 8
+#define IP6_DROP_IP6_UNHANDLED 9
+#define IP6_DROP_COUNT 10
+
+void ip6_report_drops(void);
+
 // provided by interface driver
 void* eth_get_buffer(size_t len);
 void eth_put_buffer(void* ptr);
@@ -0,0 +1,171 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <efi.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <manifest.h>
+
+#define MANIFEST_MAX_ENTRIES 8
+#define MANIFEST_NAME_LEN 16
+
+typedef struct {
+    char name[MANIFEST_NAME_LEN];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+} manifest_entry;
+
+static manifest_entry entries[MANIFEST_MAX_ENTRIES];
+static unsigned entry_count;
+static int loaded;
+
+#ifdef MANIFEST_SHA256
+static const char pinned[] = MANIFEST_SHA256;
+#endif
+
+static int hexval(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int parse_digest(const char* s, uint8_t* digest) {
+    int hi, lo, i;
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        if (((hi = hexval(s[2 * i])) < 0) || ((lo = hexval(s[2 * i + 1])) < 0)) {
+            return -1;
+        }
+        digest[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
+
+int manifest_load(const void* data, size_t len) {
+    const char* p = data;
+    const char* end = p + len;
+    const char* eol;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    manifest_entry* e;
+    size_t n;
+
+    loaded = 0;
+    entry_count = 0;
+
+#ifdef MANIFEST_SHA256
+    sha256(data, len, digest);
+    if (((sizeof(pinned) - 1) != (2 * SHA256_DIGEST_SIZE)) ||
+        parse_digest(pinned, entries[0].digest) ||
+        memcmp(digest, entries[0].digest, sizeof(digest))) {
+        printf("manifest: does not match the pinned digest\n");
+        return -1;
+    }
+#endif
+
+    for (; p < end; p = eol + 1) {
+        for (eol = p; (eol < end) && (*eol != '\n'); eol++) {
+            ;
+        }
+        if (eol == p) {
+            continue;
+        }
+        n = eol - p;
+        if ((n < (2 * SHA256_DIGEST_SIZE + 2)) || (p[2 * SHA256_DIGEST_SIZE] != ' ') ||
+            ((n - 2 * SHA256_DIGEST_SIZE - 1) >= MANIFEST_NAME_LEN) ||
+            parse_digest(p, digest)) {
+            printf("manifest: malformed line\n");
+            goto fail;
+        }
+        if (entry_count == MANIFEST_MAX_ENTRIES) {
+            printf("manifest: too many entries\n");
+            goto fail;
+        }
+        e = entries + entry_count++;
+        memset(e->name, 0, sizeof(e->name));
+        memcpy(e->name, p + 2 * SHA256_DIGEST_SIZE + 1, n - 2 * SHA256_DIGEST_SIZE - 1);
+        memcpy(e->digest, digest, sizeof(digest));
+    }
+
+#ifndef MANIFEST_SHA256
+    printf("manifest: not pinned, checking for corruption only\n");
+#endif
+    printf("manifest: %d entries (sha256 engine %s)\n", entry_count, sha256_engine_name());
+    loaded = 1;
+    return 0;
+
+fail:
+    entry_count = 0;
+    return -1;
+}
+
+int manifest_active(void) {
+#ifdef MANIFEST_SHA256
+    return 1;
+#else
+    return loaded;
+#endif
+}
+
+static int check(const char* name, const uint8_t* digest) {
+    unsigned i;
+
+    for (i = 0; i < entry_count; i++) {
+        if (strcmp(entries[i].name, name)) {
+            continue;
+        }
+        if (digest == NULL) {
+            printf("manifest: '%s' is missing\n", name);
+            return -1;
+        }
+        if (memcmp(entries[i].digest, digest, SHA256_DIGEST_SIZE)) {
+            printf("manifest: '%s' does not match\n", name);
+            return -1;
+        }
+        return 0;
+    }
+    if (digest != NULL) {
+        printf("manifest: '%s' is not listed\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int manifest_verify(const uint8_t* kernel, const uint8_t* ramdisk,
+                    const void* cmdline, size_t cmdline_len) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (!manifest_active()) {
+        return 0;
+    }
+    if (!loaded) {
+        printf("manifest: required, but none was found\n");
+        return -1;
+    }
+    if (cmdline && cmdline_len) {
+        sha256c(cmdline, cmdline_len, digest);
+    }
+    if (check("kernel", kernel) || check("ramdisk", ramdisk) ||
+        check("cmdline", (cmdline && cmdline_len) ? digest : NULL)) {
+        return -1;
+    }
+    printf("manifest: boot files verified\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sha256.h>
+
+// A boot manifest lists the chunked SHA-256 digest (sha256c()) of
+// each file osboot boots, one "<hex digest> <name>" line per file,
+// as written by out/mkmanifest.  The names checked are "kernel",
+// "ramdisk", and "cmdline"; a netbooted EFI app is the "kernel".
+//
+// If osboot is built with MANIFEST_SHA256 (the plain SHA-256 of the
+// manifest file), only a manifest with that digest is accepted and
+// nothing boots without one.  Otherwise any manifest found is used,
+// with a warning, to catch corrupt images.
+
+// Parse and authenticate a manifest, replacing any earlier one.
+// Returns 0 on success.
+int manifest_load(const void* data, size_t len);
+
+// Nonzero if files must be hashed as they load, for
+// manifest_verify(): one is loaded or one is required.
+int manifest_active(void);
+
+// Check the digests of the files about to be booted (NULL if that
+// file is absent) against the manifest.  The cmdline is hashed
+// here.  Returns 0 if the boot may proceed.
+int manifest_verify(const uint8_t* kernel, const uint8_t* ramdisk,
+                    const void* cmdline, size_t cmdline_len);
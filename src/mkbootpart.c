@@ -0,0 +1,175 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+
+#include "bootpart.h"
+
+static char* appname;
+static bootpart_hdr hdr;
+static uint64_t next = BOOTPART_HDR_SIZE;
+
+void usage(void) {
+    fprintf(stderr,
+            "usage: %s -o <image> -k <kernel> [ -r <ramdisk> ] [ -c <cmdline> ]\n"
+            "\n"
+            "Build a boot image for a GPT partition of type\n"
+            BOOTPART_TYPE_GUID_STR "\n",
+            appname);
+    exit(1);
+}
+
+static uint64_t align(uint64_t n) {
+    return (n + BOOTPART_ALIGN - 1) & ~((uint64_t)BOOTPART_ALIGN - 1);
+}
+
+// The size of the real-mode setup code preceding the image proper,
+// matching what osboot computes from the header.
+static uint64_t setup_size(int fd) {
+    uint8_t buf[1024];
+
+    if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        return 0;
+    }
+    if (memcmp(buf + 0x202, "HdrS", 4)) {
+        return 0;
+    }
+    return (buf[0x1F1] + 1) * 512;
+}
+
+static int add(int out, const char* name, const char* fn, int is_kernel) {
+    bootpart_extent* e;
+    uint8_t buf[65536];
+    struct stat st;
+    uint64_t off;
+    ssize_t r;
+    int fd;
+
+    if (hdr.count == BOOTPART_MAX_EXTENTS) {
+        fprintf(stderr, "%s: too many extents\n", appname);
+        return -1;
+    }
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, fn);
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "%s: cannot stat '%s'\n", appname, fn);
+        goto fail;
+    }
+
+    if (is_kernel) {
+        // the image past the setup sectors is what gets read in
+        // bulk, so that is the part which should be aligned
+        uint64_t setup = setup_size(fd);
+        off = align(next + setup) - setup;
+    } else {
+        off = align(next);
+    }
+
+    e = hdr.extent + hdr.count++;
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    e->offset = off;
+    e->size = st.st_size;
+
+    if (lseek(out, off, SEEK_SET) != (off_t)off) {
+        goto fail;
+    }
+    while ((r = read(fd, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, r) != r) {
+            fprintf(stderr, "%s: write error\n", appname);
+            goto fail;
+        }
+    }
+    if (r < 0) {
+        fprintf(stderr, "%s: error reading '%s'\n", appname, fn);
+        goto fail;
+    }
+    next = off + st.st_size;
+    close(fd);
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int main(int argc, char** argv) {
+    const char* out_fn = NULL;
+    const char* kernel = NULL;
+    const char* ramdisk = NULL;
+    const char* cmdline = NULL;
+    int fd;
+
+    appname = argv[0];
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "-o")) {
+            out_fn = argv[2];
+        } else if (!strcmp(argv[1], "-k")) {
+            kernel = argv[2];
+        } else if (!strcmp(argv[1], "-r")) {
+            ramdisk = argv[2];
+        } else if (!strcmp(argv[1], "-c")) {
+            cmdline = argv[2];
+        } else {
+            usage();
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if ((argc != 1) || (out_fn == NULL) || (kernel == NULL)) {
+        usage();
+    }
+
+    if ((fd = open(out_fn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "%s: cannot create '%s'\n", appname, out_fn);
+        return -1;
+    }
+    hdr.magic = BOOTPART_MAGIC;
+    hdr.version = BOOTPART_VERSION;
+    if (add(fd, "kernel.bin", kernel, 1)) {
+        goto fail;
+    }
+    if (ramdisk && add(fd, "ramdisk.bin", ramdisk, 0)) {
+        goto fail;
+    }
+    if (cmdline && add(fd, "cmdline", cmdline, 0)) {
+        goto fail;
+    }
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        fprintf(stderr, "%s: write error\n", appname);
+        goto fail;
+    }
+    // pad to a whole extent so the tail can be read in blocks
+    if (ftruncate(fd, align(next))) {
+        goto fail;
+    }
+    close(fd);
+    return 0;
+
+fail:
+    close(fd);
+    unlink(out_fn);
+    return -1;
+}
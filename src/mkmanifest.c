@@ -0,0 +1,220 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Build a boot manifest: one line per boot file, giving the chunked
+// SHA-256 digest (see include/sha256.h) of its contents, and print
+// the digest of the manifest itself, for pinning into osboot with
+// make MANIFEST_SHA256=<digest>.  lib/sha256.c is linked in, with
+// mp_run() from src/mp-host.c.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+static char* appname;
+
+void usage(void) {
+    fprintf(stderr,
+            "usage: %s -o <manifest> <name>=<file> ...\n"
+            "       %s -b                (benchmark the hash engines)\n"
+            "\n"
+            "names osboot checks: kernel, ramdisk, cmdline\n",
+            appname, appname);
+    exit(1);
+}
+
+static void hex(char* out, const uint8_t* digest) {
+    int i;
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        sprintf(out + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static void* load(const char* fn, size_t* sz) {
+    struct stat st;
+    uint8_t* data;
+    ssize_t r;
+    size_t n;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, fn);
+        return NULL;
+    }
+    if (fstat(fd, &st) || ((data = malloc(st.st_size + 1)) == NULL)) {
+        fprintf(stderr, "%s: cannot load '%s'\n", appname, fn);
+        close(fd);
+        return NULL;
+    }
+    for (n = 0; n < st.st_size; n += r) {
+        if ((r = read(fd, data + n, st.st_size - n)) <= 0) {
+            fprintf(stderr, "%s: cannot read '%s'\n", appname, fn);
+            free(data);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    *sz = n;
+    return data;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Digest in odd sized pieces, as a loader would.
+static int stream(const uint8_t* data, size_t len, const uint8_t* want) {
+    uint8_t got[SHA256_DIGEST_SIZE];
+    sha256c_ctx ctx;
+    size_t n;
+
+    sha256c_init(&ctx);
+    for (; len > 0; data += n, len -= n) {
+        n = (len < 777777) ? len : 777777;
+        sha256c_update(&ctx, data, n);
+    }
+    sha256c_final(&ctx, got);
+    return memcmp(got, want, sizeof(got));
+}
+
+// Check every engine against the first (best) one, over sizes
+// around the block and chunk boundaries, then time each.
+static int bench(void) {
+    static const size_t sizes[] = {
+        0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000,
+        SHA256C_CHUNK - 1, SHA256C_CHUNK, SHA256C_CHUNK + 1,
+        8 * SHA256C_CHUNK, 8 * SHA256C_CHUNK + 100, 17 * SHA256C_CHUNK - 3,
+    };
+    size_t len = 64 * SHA256C_CHUNK;
+    uint8_t want[2 * (sizeof(sizes) / sizeof(sizes[0]))][SHA256_DIGEST_SIZE];
+    uint8_t got[SHA256_DIGEST_SIZE];
+    char str[2 * SHA256_DIGEST_SIZE + 1];
+    uint8_t* data;
+    int best = sha256_engine();
+    int e, failed = 0;
+    unsigned i, reps;
+    double t;
+
+    if ((data = malloc(len)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        data[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sha256(data, sizes[i], want[2 * i]);
+        sha256c(data, sizes[i], want[2 * i + 1]);
+        hex(str, want[2 * i]);
+        printf("%9zu %s\n", sizes[i], str);
+    }
+
+    for (e = best; e >= SHA256_GENERIC; e--) {
+        sha256_set_engine(e);
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            sha256(data, sizes[i], got);
+            failed |= memcmp(got, want[2 * i], sizeof(got));
+            sha256c(data, sizes[i], got);
+            failed |= memcmp(got, want[2 * i + 1], sizeof(got));
+            failed |= stream(data, sizes[i], want[2 * i + 1]);
+            if (failed) {
+                fprintf(stderr, "%s: %s engine differs at %zu bytes\n",
+                        appname, sha256_engine_name(), sizes[i]);
+                return -1;
+            }
+        }
+        reps = (e == SHA256_GENERIC) ? 1 : 4;
+        t = now();
+        for (i = 0; i < reps; i++) {
+            sha256c(data, len, got);
+        }
+        t = now() - t;
+        printf("%-8s %8.1f MB/s (one CPU)\n", sha256_engine_name(),
+               (double)reps * len / t / (1024 * 1024));
+    }
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char str[2 * SHA256_DIGEST_SIZE + 1];
+    const char* out_fn = NULL;
+    sha256_ctx manifest;
+    char* fn;
+    void* data;
+    size_t sz;
+    FILE* out;
+
+    appname = argv[0];
+    if ((argc == 2) && !strcmp(argv[1], "-b")) {
+        return bench() ? 1 : 0;
+    }
+    if ((argc < 4) || strcmp(argv[1], "-o")) {
+        usage();
+    }
+    out_fn = argv[2];
+    argc -= 3;
+    argv += 3;
+
+    if ((out = fopen(out_fn, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot create '%s'\n", appname, out_fn);
+        return 1;
+    }
+    sha256_init(&manifest);
+    for (; argc > 0; argc--, argv++) {
+        if ((fn = strchr(argv[0], '=')) == NULL) {
+            usage();
+        }
+        *fn++ = 0;
+        if ((data = load(fn, &sz)) == NULL) {
+            goto fail;
+        }
+        sha256c(data, sz, digest);
+        free(data);
+        hex(str, digest);
+        fprintf(out, "%s %s\n", str, argv[0]);
+
+        // the manifest digest covers exactly the bytes written
+        sha256_update(&manifest, str, strlen(str));
+        sha256_update(&manifest, " ", 1);
+        sha256_update(&manifest, argv[0], strlen(argv[0]));
+        sha256_update(&manifest, "\n", 1);
+    }
+    if (fclose(out)) {
+        fprintf(stderr, "%s: cannot write '%s'\n", appname, out_fn);
+        return 1;
+    }
+    sha256_final(&manifest, digest);
+    hex(str, digest);
+    printf("MANIFEST_SHA256=%s\n", str);
+    return 0;
+
+fail:
+    fclose(out);
+    unlink(out_fn);
+    return 1;
+}
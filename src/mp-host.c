@@ -0,0 +1,25 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// mp_run() for host tools linking lib/sha256.c: everything runs
+// on the calling thread.
+
+#include <stddef.h>
+
+void mp_run(void (*func)(void* arg, size_t index), void* arg, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        func(arg, i);
+    }
+}
@@ -0,0 +1,527 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A netboot device on the host: src/inet6.c and src/netboot.c over a
+// tap interface, with an impaired link (src/impair.c) between them and
+// the wire, to test and benchmark against out/nbserver.
+
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "impair.h"
+#include "inet6.h"
+#include "netboot.h"
+#include "netifc.h"
+
+static char* appname;
+
+static int tap_fd = -1;
+static char tap_name[IFNAMSIZ] = "nbtap%d";
+static mac_addr tap_mac = {{ 0x02, 0x4e, 0x42, 0x00, 0x00, 0x01 }};
+
+static impair_cfg up_cfg;   // device to server
+static impair_cfg down_cfg; // server to device
+static uint64_t seed = 1;
+static impair* up;
+static impair* down;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Transmit buffers, laid out as in netifc.c: as many, and given
+// back the same way, so the stack sees the same back pressure.
+#define NUM_BUFFERS 16
+#define ETH_BUFFER_SIZE 1516
+#define ETH_BUFFER_MAGIC 0x424201020304A7A7UL
+
+typedef struct eth_buffer_t eth_buffer;
+struct eth_buffer_t {
+    uint64_t magic;
+    eth_buffer* next;
+    uint8_t data[0];
+};
+
+static uint8_t eth_buffers_base[NUM_BUFFERS][2048] __attribute__((aligned(2048)));
+static eth_buffer* eth_buffers = NULL;
+
+// sent buffers, given back one per netifc_poll() like SNP's txdone
+static void* txdone[NUM_BUFFERS];
+static unsigned txdone_head;
+static unsigned txdone_count;
+
+#define MAX_FILTER 8
+static mac_addr mcast_filters[MAX_FILTER];
+static unsigned mcast_filter_count = 0;
+
+void* eth_get_buffer(size_t sz) {
+    eth_buffer* buf;
+    if (sz > ETH_BUFFER_SIZE) {
+        return NULL;
+    }
+    if (eth_buffers == NULL) {
+        return NULL;
+    }
+    buf = eth_buffers;
+    eth_buffers = buf->next;
+    buf->next = NULL;
+    return buf->data;
+}
+
+void eth_put_buffer(void* data) {
+    eth_buffer* buf = (void*)(((uintptr_t)data) & (~2047));
+
+    if (buf->magic != ETH_BUFFER_MAGIC) {
+        fprintf(stderr, "fatal: eth buffer %p (from %p) bad magic %lx\n",
+                buf, data, buf->magic);
+        abort();
+    }
+    buf->next = eth_buffers;
+    eth_buffers = buf;
+}
+
+int eth_send(void* data, size_t len) {
+    impair_send(up, data, len, now_us());
+    txdone[(txdone_head + txdone_count++) % NUM_BUFFERS] = data;
+    return 0;
+}
+
+int eth_add_mcast_filter(const mac_addr* addr) {
+    if (mcast_filter_count >= MAX_FILTER)
+        return -1;
+    mcast_filters[mcast_filter_count++] = *addr;
+    return 0;
+}
+
+static void deliver_up(void* cookie, const void* frame, size_t len) {
+    if (write(tap_fd, frame, len) < 0) {
+        fprintf(stderr, "%s: tap write error %d\n", appname, errno);
+    }
+}
+
+// what the receive filters of netifc_open() would let in
+static void deliver_down(void* cookie, const void* frame, size_t len) {
+    uint8_t data[2048];
+    unsigned i;
+
+    if ((len < ETH_ADDR_LEN) || (len > sizeof(data))) {
+        return;
+    }
+    if (memcmp(frame, &tap_mac, ETH_ADDR_LEN)) {
+        for (i = 0; i < mcast_filter_count; i++) {
+            if (!memcmp(frame, mcast_filters + i, ETH_ADDR_LEN)) {
+                break;
+            }
+        }
+        if (i == mcast_filter_count) {
+            return;
+        }
+    }
+    // eth_recv() works in place
+    memcpy(data, frame, len);
+    eth_recv(data, len);
+}
+
+static int tap_open(void) {
+    struct ifreq ifr;
+    char path[64];
+    int fd, s;
+
+    if ((tap_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0) {
+        fprintf(stderr, "%s: cannot open /dev/net/tun %d\n", appname, errno);
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, tap_name, IFNAMSIZ - 1);
+    if (ioctl(tap_fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "%s: cannot create tap %s %d\n", appname, tap_name, errno);
+        goto fail;
+    }
+    memcpy(tap_name, ifr.ifr_name, IFNAMSIZ);
+
+    // the host's end need not wait out duplicate address detection
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv6/conf/%s/accept_dad", tap_name);
+    if ((fd = open(path, O_WRONLY)) >= 0) {
+        if (write(fd, "0", 1) < 0) {
+            fprintf(stderr, "%s: cannot disable DAD on %s\n", appname, tap_name);
+        }
+        close(fd);
+    }
+
+    if ((s = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
+        goto fail;
+    }
+    if ((ioctl(s, SIOCGIFFLAGS, &ifr) < 0) ||
+        ((ifr.ifr_flags |= IFF_UP), ioctl(s, SIOCSIFFLAGS, &ifr) < 0)) {
+        fprintf(stderr, "%s: cannot bring up %s %d\n", appname, tap_name, errno);
+        close(s);
+        goto fail;
+    }
+    close(s);
+    fprintf(stderr, "%s: device on %s\n", appname, tap_name);
+    return 0;
+
+fail:
+    close(tap_fd);
+    tap_fd = -1;
+    return -1;
+}
+
+int netifc_open(void) {
+    unsigned i;
+
+    if (tap_open()) {
+        return -1;
+    }
+    if (((up = impair_create(&up_cfg, seed, deliver_up, NULL)) == NULL) ||
+        ((down = impair_create(&down_cfg, seed + 1, deliver_down, NULL)) == NULL)) {
+        fprintf(stderr, "%s: out of memory\n", appname);
+        return -1;
+    }
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        eth_buffer* buf = (void*)eth_buffers_base[i];
+        buf->magic = ETH_BUFFER_MAGIC;
+        eth_put_buffer(buf);
+    }
+    ip6_init(&tap_mac);
+    return 0;
+}
+
+void netifc_close(void) {
+    close(tap_fd);
+    tap_fd = -1;
+}
+
+int netifc_active(void) {
+    return (tap_fd >= 0);
+}
+
+void netifc_poll(void) {
+    uint8_t data[2048];
+    uint64_t now = now_us();
+    ssize_t r;
+
+    if (txdone_count) {
+        eth_put_buffer(txdone[txdone_head]);
+        txdone_head = (txdone_head + 1) % NUM_BUFFERS;
+        txdone_count--;
+    }
+
+    while ((r = read(tap_fd, data, sizeof(data))) > 0) {
+        impair_send(down, data, r, now);
+    }
+    impair_poll(up, now);
+    impair_poll(down, now);
+}
+
+static uint64_t net_timer = 0;
+
+void netifc_set_timer(uint32_t ms) {
+    net_timer = now_us() + ms * 1000ULL;
+}
+
+int netifc_timer_expired(void) {
+    return (net_timer != 0) && (now_us() >= net_timer);
+}
+
+// Sleep until the tap has a frame, or the link or the timer is due.
+// The device polls, so never sleep long: a benchmark source sends
+// one frame per netboot_poll().
+static void wait_for_work(void) {
+    struct pollfd fds;
+    uint64_t now = now_us();
+    uint64_t until = now + 1000;
+    uint64_t t;
+
+    if (((t = impair_poll(up, now)) != 0) && (t < until)) {
+        until = t;
+    }
+    if (((t = impair_poll(down, now)) != 0) && (t < until)) {
+        until = t;
+    }
+    if (net_timer && (net_timer < until)) {
+        until = net_timer;
+    }
+    if ((until <= now) || txdone_count) {
+        return;
+    }
+    fds.fd = tap_fd;
+    fds.events = POLLIN;
+    poll(&fds, 1, (until - now + 999) / 1000);
+}
+
+// files as received, and as expected (name=path on the command line)
+#define MAX_FILES 4
+#define DEFAULT_SIZE (256 * 1024 * 1024)
+
+static struct {
+    char name[32];
+    nbfile file;
+    uint8_t* expect;
+    size_t expect_size;
+} files[MAX_FILES];
+static int file_count;
+
+static uint64_t xfer_start;
+
+static int file_slot(const char* name) {
+    int i;
+
+    for (i = 0; i < file_count; i++) {
+        if (!strcmp(files[i].name, name)) {
+            return i;
+        }
+    }
+    if ((file_count == MAX_FILES) || (strlen(name) >= sizeof(files[0].name))) {
+        return -1;
+    }
+    memcpy(files[i].name, name, strlen(name) + 1);
+    return file_count++;
+}
+
+nbfile* netboot_get_buffer(const char* name, size_t size, int sized) {
+    int i = file_slot(name);
+    nbfile* f;
+
+    if (i < 0) {
+        return NULL;
+    }
+    if (xfer_start == 0) {
+        xfer_start = now_us();
+    }
+    f = &files[i].file;
+    free(f->data);
+    memset(f, 0, sizeof(*f));
+    f->size = sized ? size : DEFAULT_SIZE;
+    if ((f->data = malloc(f->size ? f->size : 1)) == NULL) {
+        f->size = 0;
+        return NULL;
+    }
+    return f;
+}
+
+int netboot_file_header(nbfile* file) {
+    return 0;
+}
+
+static int expect_file(const char* arg) {
+    const char* fn = strchr(arg, '=');
+    char name[32];
+    struct stat st;
+    int fd, i;
+
+    if ((fn == NULL) || ((fn - arg) >= sizeof(name))) {
+        return -1;
+    }
+    memcpy(name, arg, fn - arg);
+    name[fn - arg] = 0;
+    fn++;
+    if ((i = file_slot(name)) < 0) {
+        fprintf(stderr, "%s: too many files\n", appname);
+        return -1;
+    }
+    if (((fd = open(fn, O_RDONLY)) < 0) || fstat(fd, &st)) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, fn);
+        return -1;
+    }
+    files[i].expect_size = st.st_size;
+    if (((files[i].expect = malloc(st.st_size + 1)) == NULL) ||
+        (read(fd, files[i].expect, st.st_size) != st.st_size)) {
+        fprintf(stderr, "%s: cannot read '%s'\n", appname, fn);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Check what arrived against what was expected.
+static int check_files(void) {
+    int i, bad = 0;
+
+    for (i = 0; i < file_count; i++) {
+        nbfile* f = &files[i].file;
+        if (files[i].expect == NULL) {
+            continue;
+        }
+        if (f->data == NULL) {
+            fprintf(stderr, "%s: %s never arrived\n", appname, files[i].name);
+            bad = 1;
+        } else if ((f->offset != files[i].expect_size) ||
+                   memcmp(f->data, files[i].expect, f->offset)) {
+            fprintf(stderr, "%s: %s differs (%zu bytes, expected %zu)\n", appname,
+                    files[i].name, f->offset, files[i].expect_size);
+            bad = 1;
+        }
+    }
+    return bad;
+}
+
+static void print_link(const char* dir, impair* link) {
+    impair_stats st;
+
+    impair_get_stats(link, &st);
+    printf(" %s %lu/%lu/%lu/%lu/%lu", dir, st.frames, st.dropped,
+           st.overflowed, st.duplicated, st.reordered);
+}
+
+void usage(void) {
+    fprintf(stderr,
+            "usage:   %s [ <option> ]* [ <name>=<file> ]*\n"
+            "\n"
+            "Run a netboot device on a tap interface until it is told to\n"
+            "boot, then check each file <name> it received against <file>.\n"
+            "\n"
+            "options: -i <impairments>  impair both directions of the link\n"
+            "         -u <impairments>  impair frames the device sends\n"
+            "         -d <impairments>  impair frames the device receives\n"
+            "         -s <seed>  seed the impairments (default 1)\n"
+            "         -t <name>  tap interface to create (default nbtap%%d)\n"
+            "         -T <seconds>  give up if not booted by then\n"
+            "         -m <mac>  the device's MAC address (default\n"
+            "             02:4e:42:00:00:01)\n"
+            "         -n <serialno>  -b <board>  what the device's beacons\n"
+            "             say it is (default unknown)\n"
+            "\n"
+            "impairments: a list such as loss=2,dup=0.5,reorder=1,delay=5ms,\n"
+            "         jitter=1ms,rate=100mbit,limit=64 (loss, dup and reorder\n"
+            "         are percentages of frames; limit is in frames)\n"
+            "\n"
+            "On boot, prints a line to stdout:\n"
+            "  boot <bytes> <seconds> <MB/s> up <frames>/<dropped>/<overflowed>/\n"
+            "  <duplicated>/<reordered> down <...> (ok|bad)\n",
+            appname);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint64_t bytes = 0, deadline = 0;
+    const char* serialno = NULL;
+    const char* board = NULL;
+    double secs;
+    int i, bad;
+
+    appname = argv[0];
+
+    while (argc > 1) {
+        if (argv[1][0] != '-') {
+            if (expect_file(argv[1])) {
+                usage();
+            }
+        } else if (!strcmp(argv[1], "-i") && (argc > 2)) {
+            if (impair_parse(&up_cfg, argv[2]) || impair_parse(&down_cfg, argv[2])) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-u") && (argc > 2)) {
+            if (impair_parse(&up_cfg, argv[2])) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-d") && (argc > 2)) {
+            if (impair_parse(&down_cfg, argv[2])) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-s") && (argc > 2)) {
+            seed = strtoull(argv[2], NULL, 0);
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-t") && (argc > 2)) {
+            strncpy(tap_name, argv[2], sizeof(tap_name) - 1);
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-m") && (argc > 2)) {
+            uint8_t* m = tap_mac.x;
+            if (sscanf(argv[2], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                       m, m + 1, m + 2, m + 3, m + 4, m + 5) != 6) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-n") && (argc > 2)) {
+            serialno = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-b") && (argc > 2)) {
+            board = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-T") && (argc > 2)) {
+            deadline = now_us() + strtoull(argv[2], NULL, 0) * 1000000ULL;
+            argc--;
+            argv++;
+        } else {
+            usage();
+        }
+        argc--;
+        argv++;
+    }
+
+    netboot_set_identity(serialno, board);
+    if (netboot_init()) {
+        return 1;
+    }
+    for (;;) {
+        if (netboot_poll()) {
+            break;
+        }
+        if (deadline && (now_us() > deadline)) {
+            fprintf(stderr, "%s: timed out\n", appname);
+            netboot_close();
+            return 2;
+        }
+        wait_for_work();
+    }
+    secs = (now_us() - xfer_start) / 1000000.0;
+
+    // let the boot command's ack make it onto the wire
+    while (impair_poll(up, now_us())) {
+        wait_for_work();
+    }
+
+    for (i = 0; i < file_count; i++) {
+        bytes += files[i].file.offset;
+    }
+    bad = check_files();
+    printf("boot %lu %.3f %.3f", bytes, secs, bytes / secs / 1000000.0);
+    print_link("up", up);
+    print_link("down", down);
+    printf(" %s\n", bad ? "bad" : "ok");
+    netboot_close();
+    return bad;
+}
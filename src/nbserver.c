@@ -13,30 +13,107 @@
 // limitations under the License.
 
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
 #include <netinet/in.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
 #include <stdint.h>
 
 #include "netboot.h"
+#include "sha256.h"
 
 static uint32_t cookie = 1;
 static char* appname;
 
+// resends by io(), for the benchmarks
+static unsigned io_timeouts;
+
+// directory for per-device logs (NB_LOG), or NULL to ignore them
+static const char* logdir;
+
+#define MAX_LOG_DEVICES 64
+
+// where each device's log left off, to spot gaps and reboots
+static struct {
+    struct in6_addr addr;
+    uint32_t next;
+} logdev[MAX_LOG_DEVICES];
+static int logdev_count;
+static int logdev_evict;
+
+static void save_log(struct sockaddr_in6* ra, nbmsg* msg, size_t len) {
+    char tmp[INET6_ADDRSTRLEN];
+    char path[4096];
+    uint32_t* next = NULL;
+    FILE* fp;
+    int i;
+
+    if (logdir == NULL) {
+        return;
+    }
+    for (i = 0; i < logdev_count; i++) {
+        if (!memcmp(&logdev[i].addr, &ra->sin6_addr, sizeof(ra->sin6_addr))) {
+            next = &logdev[i].next;
+            break;
+        }
+    }
+    inet_ntop(AF_INET6, &ra->sin6_addr, tmp, sizeof(tmp));
+    snprintf(path, sizeof(path), "%s/%s.log", logdir, tmp);
+    if ((fp = fopen(path, "a")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, path);
+        return;
+    }
+    if (next == NULL) {
+        i = (logdev_count < MAX_LOG_DEVICES) ? logdev_count++ : logdev_evict++ % MAX_LOG_DEVICES;
+        logdev[i].addr = ra->sin6_addr;
+        next = &logdev[i].next;
+        *next = msg->arg;
+        if (msg->arg == 0) {
+            fprintf(fp, "\n--- [%s] boot ---\n", tmp);
+        }
+    } else if (msg->arg < *next) {
+        fprintf(fp, "\n--- [%s] reboot ---\n", tmp);
+    } else if (msg->arg > *next) {
+        fprintf(fp, "\n--- [%s] %u bytes lost ---\n", tmp, msg->arg - *next);
+    }
+    fwrite(msg->data, 1, len, fp);
+    fclose(fp);
+    *next = msg->arg + len;
+}
+
+// transfers under way (see session_start())
+static int sessions_active;
+
+// Print a progress mark, unless several transfers would mix theirs.
+static void mark(char c) {
+    if (__atomic_load_n(&sessions_active, __ATOMIC_RELAXED) <= 1) {
+        fputc(c, stderr);
+    }
+}
+
+// Send msg and wait for its ack, retrying on timeouts.  Returns 0
+// once acked, 1 if the device refused it, and -1 on failure.
 static int io(int s, nbmsg* msg, size_t len, nbmsg* ack) {
     int retries = 5;
     int r;
 
     msg->magic = NB_MAGIC;
-    msg->cookie = cookie++;
+    msg->cookie = __atomic_fetch_add(&cookie, 1, __ATOMIC_RELAXED);
 
     for (;;) {
         r = write(s, msg, len);
@@ -52,8 +129,9 @@ static int io(int s, nbmsg* msg, size_t len, nbmsg* ack) {
         if (r < 0) {
             if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                 retries--;
+                __atomic_fetch_add(&io_timeouts, 1, __ATOMIC_RELAXED);
                 if (retries > 0) {
-                    fprintf(stderr, "T");
+                    mark('T');
                     continue;
                 }
                 fprintf(stderr, "\n%s: timed out\n", appname);
@@ -63,45 +141,811 @@ static int io(int s, nbmsg* msg, size_t len, nbmsg* ack) {
             return -1;
         }
         if (r < sizeof(nbmsg)) {
-            fprintf(stderr, "Z");
+            mark('Z');
             goto again;
         }
         if (ack->magic != NB_MAGIC) {
-            fprintf(stderr, "?");
+            mark('?');
             goto again;
         }
         if (ack->cookie != msg->cookie) {
-            fprintf(stderr, "C");
+            mark('C');
             goto again;
         }
-        if (ack->arg != msg->arg) {
-            fprintf(stderr, "A");
+        if (ack->cmd & NB_ERROR) {
+            // refused; the caller may look at ack->cmd
+            return 1;
+        }
+        // file starts are acked with the device's own arg: the offset
+        // to resume from, or 0 (firmware that ignores the size)
+        if ((msg->cmd != NB_RESUME_FILE) && (msg->cmd != NB_SEND_FILE) &&
+            (ack->arg != msg->arg)) {
+            mark('A');
             goto again;
         }
         if (ack->cmd == NB_ACK)
             return 0;
-        fprintf(stderr, "?");
+        mark('?');
         goto again;
     }
 }
 
-static void xfer(struct sockaddr_in6* addr, const char* fn) {
+// A file sent to the device, held in memory between sends.
+typedef struct {
+    const char* name; // as the device knows it
+    const char* fn;
+    uint8_t* data;
+    size_t size;
+    struct timespec mtime;
+    ino_t ino;
+    uint8_t ident[NB_IDENT_LEN]; // sha256c() of data
+
+    // watch mode: the directory watch, and a change not yet loaded
+    int wd;
+    const char* base;
+    int changed;
+} boot_file;
+
+// manifest, cmdline, ramdisk, then the kernel
+#define MAX_FILES 4
+static const char* file_names[MAX_FILES] = {
+    "manifest", "cmdline", "ramdisk.bin", "kernel.bin",
+};
+
+// The files sent to devices whose beacons have key=value (see -i).
+// Set 0 holds the files named on the command line, for devices that
+// match no other set.
+typedef struct {
+    const char* key;
+    const char* value;
+    char label[64];
+    boot_file files[MAX_FILES];
+    int file_count;
+    int users;      // sessions sending these files
+    unsigned build; // watch mode: 0 until every file has loaded
+} image_set;
+
+#define MAX_SETS 64
+static image_set sets[MAX_SETS];
+static int set_count = 1;
+
+// Add the file the device knows as name, in its place in the send
+// order.  Returns -1 if name is not one the device takes.
+static int add_file(image_set* set, const char* name, const char* fn) {
+    boot_file* f;
+    const char* slash;
+    int i, j;
+
+    for (i = 0; i < MAX_FILES; i++) {
+        if (!strcmp(name, file_names[i])) {
+            break;
+        }
+    }
+    if (i == MAX_FILES) {
+        return -1;
+    }
+    for (j = 0; j < set->file_count; j++) {
+        if (!strcmp(set->files[j].name, name)) {
+            return -1;
+        }
+    }
+    // after any file that goes first
+    for (j = set->file_count; j > 0; j--) {
+        int k;
+        for (k = 0; strcmp(set->files[j - 1].name, file_names[k]); k++)
+            ;
+        if (k < i) {
+            break;
+        }
+        set->files[j] = set->files[j - 1];
+    }
+    f = set->files + j;
+    memset(f, 0, sizeof(*f));
+    f->name = file_names[i];
+    f->fn = fn;
+    f->wd = -1;
+    f->base = ((slash = strrchr(fn, '/')) != NULL) ? (slash + 1) : fn;
+    set->file_count++;
+    return 0;
+}
+
+// Read an image map: one set per line, "<key>=<value>" to match in
+// beacons (serialno, board or mac), then "<name>=<file>" for each
+// file to send, where name is kernel.bin, ramdisk.bin, cmdline or
+// manifest.  Blank lines and lines starting with '#' are skipped.
+static int load_map(const char* fn) {
+    char line[4096];
+    char* word;
+    char* eq;
+    image_set* set;
+    int n = 0;
+    FILE* fp;
+
+    if ((fp = fopen(fn, "r")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, fn);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        n++;
+        if ((word = strtok(line, " \t\r\n")) == NULL || (word[0] == '#')) {
+            continue;
+        }
+        if ((set_count == MAX_SETS) || ((eq = strchr(word, '=')) == NULL)) {
+            goto bad;
+        }
+        set = sets + set_count;
+        *eq = 0;
+        set->key = strdup(word);
+        set->value = strdup(eq + 1);
+        snprintf(set->label, sizeof(set->label), "%s=%s", set->key, set->value);
+        while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+            if ((eq = strchr(word, '=')) == NULL) {
+                goto bad;
+            }
+            *eq = 0;
+            if (add_file(set, word, strdup(eq + 1))) {
+                goto bad;
+            }
+        }
+        if ((set->file_count == 0) || strcmp(set->files[set->file_count - 1].name, "kernel.bin")) {
+            goto bad;
+        }
+        set_count++;
+    }
+    fclose(fp);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: %s:%d: bad image set\n", appname, fn, n);
+    fclose(fp);
+    return -1;
+}
+
+// The value of key in a beacon, or NULL.
+static const char* advert_get(const char* data, size_t len, const char* key) {
+    const char* end = data + len;
+    const char* value;
+
+    while (data < end) {
+        value = data + strnlen(data, end - data) + 1;
+        if (value >= end) {
+            break;
+        }
+        if (!strcmp(data, key)) {
+            return value;
+        }
+        data = value + strnlen(value, end - value) + 1;
+    }
+    return NULL;
+}
+
+// The first set matching a beacon, or NULL if none (not even set 0).
+static image_set* match_set(const char* data, size_t len) {
+    const char* value;
+    int i;
+
+    for (i = 1; i < set_count; i++) {
+        value = advert_get(data, len, sets[i].key);
+        if (value && !strcasecmp(value, sets[i].value)) {
+            return sets + i;
+        }
+    }
+    return sets[0].file_count ? sets : NULL;
+}
+
+// (Re)load a file into memory.  Returns 1 if it changed while
+// being read, so it should be tried again later.
+static int load_file(boot_file* f) {
+    struct stat st, st2;
+    uint8_t* data = NULL;
+    ssize_t r;
+    size_t n;
+    int fd;
+
+    if ((fd = open(f->fn, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, f->fn);
+        return -1;
+    }
+    if ((fstat(fd, &st) < 0) || (st.st_size > UINT32_MAX) ||
+        ((data = malloc(st.st_size + 1)) == NULL)) {
+        fprintf(stderr, "%s: cannot size '%s'\n", appname, f->fn);
+        goto fail;
+    }
+    for (n = 0; n < st.st_size; n += r) {
+        if ((r = read(fd, data + n, st.st_size - n)) <= 0) {
+            fprintf(stderr, "%s: error: reading '%s'\n", appname, f->fn);
+            goto fail;
+        }
+    }
+    close(fd);
+    if ((stat(f->fn, &st2) < 0) || (st2.st_size != st.st_size) ||
+        (st2.st_ino != st.st_ino) || (st2.st_mtim.tv_sec != st.st_mtim.tv_sec) ||
+        (st2.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        free(data);
+        return 1;
+    }
+    free(f->data);
+    f->data = data;
+    f->size = n;
+    f->mtime = st.st_mtim;
+    f->ino = st.st_ino;
+    sha256c(data, n, f->ident);
+    return 0;
+
+fail:
+    free(data);
+    close(fd);
+    return -1;
+}
+
+// Whether the file on disk is not the one loaded (or none is).
+static int file_stale(boot_file* f) {
+    struct stat st;
+
+    return (f->data == NULL) || (stat(f->fn, &st) < 0) ||
+        (st.st_size != f->size) || (st.st_ino != f->ino) ||
+        (st.st_mtim.tv_sec != f->mtime.tv_sec) ||
+        (st.st_mtim.tv_nsec != f->mtime.tv_nsec);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Attempts at sending a file, each carrying on from the last
+#define SEND_TRIES 5
+
+// FEC mode (-f): groups of fec_k blocks are sent back to back with
+// fec_m parity blocks (see NB_FEC_PARITY) and acked once a group,
+// so a lost block costs no round trip unless two of one parity
+// block's share go missing.
+static unsigned fec_k;
+static unsigned fec_m;
+
+// rounds of repairs for one group before resuming the file
+#define FEC_TRIES 10
+
+// Congestion control for FEC groups, per session.  Blocks are paced
+// by a token bucket at rate bytes/s.  The rate doubles per group
+// (slow start), then grows by CC_STEP, while groups get through on
+// their parity alone; it halves when a group needs repairs or times
+// out, as the device (or a switch) dropping bursts is what does that.
+// A group's answer is waited for twice the smoothed round trip from
+// its last block, rather than for the full receive timeout.
+#define CC_START_RATE (1024 * 1024)
+#define CC_MIN_RATE (64 * 1024)
+#define CC_MAX_RATE (1024.0 * 1024 * 1024)
+#define CC_STEP (512 * 1024)
+#define CC_BURST (8 * NB_FEC_BLOCK)
+#define CC_MIN_RTO_MS 10
+#define CC_MAX_RTO_MS 250
+
+typedef struct {
+    double rate;     // bytes/s
+    double ssthresh; // slow start below this
+    double tokens;   // bytes that may be sent now
+    uint64_t last;   // when tokens were last topped up
+    uint64_t srtt;   // smoothed round trip in us, 0 until measured
+    unsigned backoffs;
+    double limit;    // the scheduler's share, in bytes/s, 0 for none
+} cc_state;
+
+static void cc_init(cc_state* cc) {
+    cc->rate = CC_START_RATE;
+    cc->ssthresh = CC_MAX_RATE;
+    cc->tokens = CC_BURST;
+    cc->last = now_us();
+    cc->srtt = 0;
+    cc->backoffs = 0;
+    cc->limit = 0;
+}
+
+// How long to wait for an answer, in ms.
+static int cc_rto(cc_state* cc) {
+    uint64_t ms = (2 * cc->srtt + 999) / 1000;
+
+    if (cc->srtt == 0) {
+        return CC_MAX_RTO_MS;
+    }
+    if (ms < CC_MIN_RTO_MS) {
+        return CC_MIN_RTO_MS;
+    }
+    return (ms > CC_MAX_RTO_MS) ? CC_MAX_RTO_MS : ms;
+}
+
+static void cc_sample(cc_state* cc, uint64_t rtt) {
+    cc->srtt = cc->srtt ? ((7 * cc->srtt + rtt) / 8) : rtt;
+}
+
+// Wait until len bytes may be sent.
+static void cc_pace(cc_state* cc, size_t len) {
+    double rate = cc->rate;
+    uint64_t t;
+
+    if (cc->limit && (cc->limit < rate)) {
+        rate = cc->limit;
+    }
+    for (;;) {
+        t = now_us();
+        cc->tokens += (t - cc->last) * rate / 1000000.0;
+        if (cc->tokens > CC_BURST) {
+            cc->tokens = CC_BURST;
+        }
+        cc->last = t;
+        if (cc->tokens >= len) {
+            break;
+        }
+        usleep((len - cc->tokens) * 1000000.0 / rate);
+    }
+    cc->tokens -= len;
+}
+
+static void cc_update(cc_state* cc, int congested) {
+    if (congested) {
+        cc->rate /= 2;
+        if (cc->rate < CC_MIN_RATE) {
+            cc->rate = CC_MIN_RATE;
+        }
+        cc->ssthresh = cc->rate;
+        cc->backoffs++;
+    } else if (cc->rate < cc->ssthresh) {
+        cc->rate *= 2;
+    } else {
+        cc->rate += CC_STEP;
+    }
+    if (cc->rate > CC_MAX_RATE) {
+        cc->rate = CC_MAX_RATE;
+    }
+}
+
+static int fec_write(int s, nbmsg* msg, size_t len) {
+    while (write(s, msg, len) < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != ENOBUFS)) {
+            fprintf(stderr, "\n%s: socket write error %d\n", appname, errno);
+            return -1;
+        }
+        // out of socket buffer; let it drain
+        usleep(100);
+    }
+    return 0;
+}
+
+// A transfer to one device.  Several may run at once, each on its
+// own thread, sharing the link as sched_rates() decides.
+typedef struct {
+    int active;
+    struct sockaddr_in6 addr;
+    char name[INET6_ADDRSTRLEN + IF_NAMESIZE];
+    image_set* set;
+    int legacy; // device lacks NB_RESUME_FILE
+    int fec;    // sending FEC groups
+    cc_state cc;
+    uint64_t start;
+    uint8_t parity[NB_FEC_MAX_M][NB_FEC_BLOCK]; // of the group being sent
+
+    // under sched_lock
+    uint64_t sent;      // bytes acked
+    uint64_t left;      // bytes the device has yet to get
+    double demand;      // bytes/s it could use
+    double alloc;       // bytes/s it may use, 0 for no limit
+    uint64_t mark;      // when sent was last sampled, for demand
+    uint64_t mark_sent;
+    uint64_t reported;  // sent, at the last status report
+} session;
+
+#define MAX_SESSIONS 64
+
+// how often a session's demand is sampled
+#define SCHED_SAMPLE_US 50000
+
+#define SCHED_FAIR 0 // max-min fair shares
+#define SCHED_SRPT 1 // shortest remaining transfer first
+
+static session sessions[MAX_SESSIONS];
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static double sched_budget; // bytes/s for all sessions, 0 for no limit
+static double sched_cap;    // bytes/s for each session, 0 for no limit
+static int sched_policy = SCHED_FAIR;
+
+static double sched_demand(session* ss) {
+    return (sched_cap && (ss->demand > sched_cap)) ? sched_cap : ss->demand;
+}
+
+static int sched_cmp(const void* a, const void* b) {
+    session* x = *(session**)a;
+    session* y = *(session**)b;
+
+    if (sched_policy == SCHED_SRPT) {
+        return (x->left > y->left) - (x->left < y->left);
+    }
+    return (sched_demand(x) > sched_demand(y)) - (sched_demand(x) < sched_demand(y));
+}
+
+// Share the budget among the active sessions (sched_lock held).  In
+// turn (least demanding first, or least left to send first), each is
+// given what it can use, up to an even split of what remains (or all
+// of it, shortest first).  No one is starved outright.
+static void sched_rates(void) {
+    session* order[MAX_SESSIONS];
+    double left = sched_budget;
+    double share;
+    int i, n = 0;
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].active) {
+            order[n++] = sessions + i;
+        }
+    }
+    if (sched_budget == 0) {
+        for (i = 0; i < n; i++) {
+            order[i]->alloc = sched_cap;
+        }
+        return;
+    }
+    qsort(order, n, sizeof(order[0]), sched_cmp);
+    for (i = 0; i < n; i++) {
+        share = (sched_policy == SCHED_SRPT) ? left : (left / (n - i));
+        if (sched_demand(order[i]) < share) {
+            share = sched_demand(order[i]);
+        }
+        if (share < CC_MIN_RATE) {
+            share = CC_MIN_RATE;
+        }
+        order[i]->alloc = share;
+        left = (left > share) ? (left - share) : 0;
+    }
+}
+
+// Account for bytes acked, note how many are left to send, and
+// take up the session's current share.
+static void sched_update(session* ss, size_t acked, uint64_t left) {
+    uint64_t t = now_us();
+    double seen;
+
+    pthread_mutex_lock(&sched_lock);
+    ss->sent += acked;
+    ss->left = left;
+    if ((t - ss->mark) >= SCHED_SAMPLE_US) {
+        // a session held to its share would never show more than
+        // that, so stop-and-wait ones are credited with twice it
+        seen = (ss->sent - ss->mark_sent) * 1000000.0 / (t - ss->mark);
+        ss->demand = ss->fec ? ss->cc.rate : (2 * seen);
+        if (ss->demand < CC_MIN_RATE) {
+            ss->demand = CC_MIN_RATE;
+        }
+        ss->mark = t;
+        ss->mark_sent = ss->sent;
+        sched_rates();
+    }
+    ss->cc.limit = ss->alloc;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Claim a session to send set to addr, unless it has one already.
+static session* session_start(struct sockaddr_in6* addr, image_set* set) {
+    session* ss = NULL;
+    int i;
+
+    pthread_mutex_lock(&sched_lock);
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].active) {
+            if (!memcmp(&sessions[i].addr.sin6_addr, &addr->sin6_addr,
+                        sizeof(addr->sin6_addr)) &&
+                (sessions[i].addr.sin6_scope_id == addr->sin6_scope_id)) {
+                ss = NULL;
+                break;
+            }
+        } else if (ss == NULL) {
+            ss = sessions + i;
+        }
+    }
+    if (ss) {
+        memset(ss, 0, sizeof(*ss));
+        ss->active = 1;
+        ss->addr = *addr;
+        ss->set = set;
+        __atomic_fetch_add(&set->users, 1, __ATOMIC_RELAXED);
+        inet_ntop(AF_INET6, &addr->sin6_addr, ss->name, sizeof(ss->name));
+        if (addr->sin6_scope_id) {
+            // link-local addresses repeat from link to link
+            char ifname[IF_NAMESIZE];
+            if (if_indextoname(addr->sin6_scope_id, ifname)) {
+                snprintf(ss->name + strlen(ss->name), sizeof(ss->name) - strlen(ss->name),
+                         "%%%s", ifname);
+            }
+        }
+        ss->fec = (fec_k != 0);
+        cc_init(&ss->cc);
+        ss->start = ss->mark = now_us();
+        // newcomers get an even share until they show their demand
+        ss->demand = CC_MAX_RATE;
+        sessions_active++;
+        sched_rates();
+        ss->cc.limit = ss->alloc;
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return ss;
+}
+
+static void session_end(session* ss) {
+    pthread_mutex_lock(&sched_lock);
+    __atomic_fetch_sub(&ss->set->users, 1, __ATOMIC_RELAXED);
+    ss->active = 0;
+    sessions_active--;
+    sched_rates();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Print the aggregate and per-session throughput since the last call.
+static void sched_report(uint64_t us) {
+    uint64_t total = 0;
+    int i;
+
+    pthread_mutex_lock(&sched_lock);
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].active) {
+            total += sessions[i].sent - sessions[i].reported;
+        }
+    }
+    fprintf(stderr, "%s: %d sessions, %.1f MB/s", appname, sessions_active,
+            total / (double)us);
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        session* ss = sessions + i;
+        if (ss->active) {
+            fprintf(stderr, ", [%s] %.1f MB/s %lu KB left", ss->name,
+                    (ss->sent - ss->reported) / (double)us, ss->left / 1024);
+            ss->reported = ss->sent;
+        }
+    }
+    fprintf(stderr, "\n");
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Length of block i of an FEC group len bytes long.
+static size_t fec_block_len(size_t len, unsigned i) {
+    len -= i * NB_FEC_BLOCK;
+    return (len < NB_FEC_BLOCK) ? len : NB_FEC_BLOCK;
+}
+
+// Send from *off to the end of f in FEC groups for ss, leaving *off
+// at the first byte not acked, with after bytes of later files to
+// follow.  Returns 0 once all of f is acked, 1 if the device refused
+// (see ack->cmd), and -1 on failure.
+static int send_fec(int s, boot_file* f, size_t* off, nbmsg* ack, session* ss, uint64_t after) {
+    uint8_t (*parity)[NB_FEC_BLOCK] = ss->parity;
+    char msgbuf[2048];
+    nbmsg* msg = (void*)msgbuf;
+    nbfec_hdr* hdr = (void*)msg->data;
+    cc_state* cc = &ss->cc;
+    uint64_t all, missing;
+    size_t pos, len, n, count = 0;
+    unsigned i, j, k, m, tries;
+    struct pollfd pfd;
+    uint64_t sent;
+    int done, ready;
+    ssize_t r;
+
+    while (*off < f->size) {
+        pos = *off;
+        len = f->size - pos;
+        if (len > (fec_k * NB_FEC_BLOCK)) {
+            len = fec_k * NB_FEC_BLOCK;
+        }
+        k = (len + NB_FEC_BLOCK - 1) / NB_FEC_BLOCK;
+        m = (fec_m < k) ? fec_m : k;
+        memset(parity, 0, sizeof(ss->parity));
+        for (i = 0; i < k; i++) {
+            n = fec_block_len(len, i);
+            for (j = 0; j < n; j++) {
+                parity[i % m][j] ^= f->data[pos + i * NB_FEC_BLOCK + j];
+            }
+        }
+        all = (k == 64) ? ~0ULL : ((1ULL << k) - 1);
+        missing = all;
+        done = 0;
+
+        // one cookie for the group, so stray answers to others are ignored
+        msg->magic = NB_MAGIC;
+        msg->cookie = __atomic_fetch_add(&cookie, 1, __ATOMIC_RELAXED);
+        for (tries = 0;; tries++) {
+            if (tries == FEC_TRIES) {
+                fprintf(stderr, "\n%s: timed out\n", appname);
+                return -1;
+            }
+            msg->cmd = NB_FEC_DATA;
+            for (i = 0; i < k; i++) {
+                if (!(missing & (1ULL << i))) {
+                    continue;
+                }
+                n = fec_block_len(len, i);
+                msg->arg = pos + i * NB_FEC_BLOCK;
+                memcpy(msg->data, f->data + msg->arg, n);
+                cc_pace(cc, n);
+                if (fec_write(s, msg, sizeof(nbmsg) + n)) {
+                    return -1;
+                }
+            }
+            // the last parity block asks for an answer, so it is
+            // resent on its own with any repairs
+            msg->cmd = NB_FEC_PARITY;
+            msg->arg = pos;
+            hdr->k = k;
+            hdr->m = m;
+            hdr->reserved = 0;
+            hdr->len = len;
+            for (j = (tries ? (m - 1) : 0); j < m; j++) {
+                hdr->index = j;
+                memcpy(hdr + 1, parity[j], NB_FEC_BLOCK);
+                cc_pace(cc, NB_FEC_BLOCK);
+                if (fec_write(s, msg, sizeof(nbmsg) + sizeof(nbfec_hdr) + NB_FEC_BLOCK)) {
+                    return -1;
+                }
+            }
+
+            sent = now_us();
+            for (;;) {
+                pfd.fd = s;
+                pfd.events = POLLIN;
+                r = -1;
+                if ((ready = poll(&pfd, 1, cc_rto(cc))) > 0) {
+                    r = read(s, ack, 2048);
+                }
+                if ((ready == 0) || (r < 0)) {
+                    // errno only means something if poll() or read() failed
+                    if ((ready != 0) &&
+                        (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                        fprintf(stderr, "\n%s: socket read error %d\n", appname, errno);
+                        return -1;
+                    }
+                    __atomic_fetch_add(&io_timeouts, 1, __ATOMIC_RELAXED);
+                    mark('T');
+                    missing = 0;
+                    break;
+                }
+                if ((r < sizeof(nbmsg)) || (ack->magic != NB_MAGIC) ||
+                    (ack->cookie != msg->cookie)) {
+                    continue;
+                }
+                cc_sample(cc, now_us() - sent);
+                if (ack->cmd & NB_ERROR) {
+                    return 1;
+                }
+                if (ack->arg >= (pos + len)) {
+                    done = 1;
+                    break;
+                }
+                if ((ack->arg == pos) && (r >= (sizeof(nbmsg) + sizeof(uint64_t)))) {
+                    memcpy(&missing, ack->data, sizeof(missing));
+                    missing &= all;
+                    mark('F');
+                    break;
+                }
+            }
+            if (done) {
+                break;
+            }
+        }
+        cc_update(cc, tries > 0);
+        *off = pos + len;
+        sched_update(ss, len, after + f->size - *off);
+        count += len;
+        while (count >= (32 * 1024)) {
+            count -= 32 * 1024;
+            mark('#');
+        }
+    }
+    return 0;
+}
+
+// Send one file over the connected socket s.  Unless ss->legacy is set
+// (or gets set, when the device turns out not to support it), the
+// device is asked how much of the file it already has.  Unless fec
+// is clear (or gets cleared, likewise), data goes in FEC groups.
+// after is how much of the later files is still to be sent.
+static int send_file(int s, boot_file* f, session* ss, uint64_t after) {
     char msgbuf[2048];
     char ackbuf[2048];
-    char tmp[INET6_ADDRSTRLEN];
-    struct timeval tv;
     nbmsg* msg = (void*)msgbuf;
     nbmsg* ack = (void*)ackbuf;
-    FILE* fp;
-    int s, r;
+    size_t off, n;
     int count = 0;
+    int tries, r;
 
-    if ((fp = fopen(fn, "rb")) == NULL) {
-        return;
+    for (tries = 0; tries < SEND_TRIES; tries++) {
+        if (tries > 0) {
+            fprintf(stderr, "%s: [%s] retrying '%s'\n", appname, ss->name, f->fn);
+        }
+        if (ss->legacy) {
+            msg->cmd = NB_SEND_FILE;
+            msg->arg = f->size;
+            strcpy((void*)msg->data, f->name);
+            r = io(s, msg, sizeof(nbmsg) + strlen(f->name) + 1, ack);
+            off = 0;
+        } else {
+            msg->cmd = NB_RESUME_FILE;
+            msg->arg = f->size;
+            memcpy(msg->data, f->ident, NB_IDENT_LEN);
+            strcpy((void*)msg->data + NB_IDENT_LEN, f->name);
+            r = io(s, msg, sizeof(nbmsg) + NB_IDENT_LEN + strlen(f->name) + 1, ack);
+            if ((r > 0) && (ack->cmd == NB_ERROR_BAD_CMD)) {
+                // an older device: start from scratch instead
+                fprintf(stderr, "%s: [%s] does not support resume\n", appname, ss->name);
+                ss->legacy = 1;
+                tries--;
+                continue;
+            }
+            off = ack->arg;
+        }
+        if (r || (off > f->size)) {
+            fprintf(stderr, "%s: [%s] failed to start transfer of '%s'\n", appname,
+                    ss->name, f->fn);
+            if (r > 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (off > 0) {
+            fprintf(stderr, "%s: [%s] resuming at %zu of %zu bytes\n", appname,
+                    ss->name, off, f->size);
+        }
+        sched_update(ss, 0, after + f->size - off);
+
+        if (ss->fec) {
+            r = send_fec(s, f, &off, ack, ss, after);
+            if ((r > 0) && (ack->cmd == NB_ERROR_BAD_CMD)) {
+                fprintf(stderr, "\n%s: [%s] does not support FEC\n", appname, ss->name);
+                ss->fec = 0;
+                r = 0;
+            }
+        }
+        if (!ss->fec) {
+            // stop-and-wait clocks itself; only the scheduler paces it
+            ss->cc.rate = CC_MAX_RATE;
+        }
+
+        msg->cmd = NB_DATA;
+        for (; (r == 0) && (off < f->size); off += n) {
+            n = ((f->size - off) < 1024) ? (f->size - off) : 1024;
+            memcpy(msg->data, f->data + off, n);
+            msg->arg = off;
+            cc_pace(&ss->cc, n);
+            if ((r = io(s, msg, sizeof(nbmsg) + n, ack))) {
+                fprintf(stderr, "\n%s: [%s] error: sending '%s'\n", appname, ss->name, f->fn);
+                break;
+            }
+            count += n;
+            if (count >= (32 * 1024)) {
+                sched_update(ss, count, after + f->size - off - n);
+                count = 0;
+                mark('#');
+            }
+        }
+        if (off < f->size) {
+            if (r > 0) {
+                return -1;
+            }
+            continue;
+        }
+        sched_update(ss, count, after);
+        if (f->size >= (32 * 1024)) {
+            mark('\n');
+        }
+        return 0;
     }
+    return -1;
+}
+
+// A socket connected to the device, for io().
+static int connect_to(struct sockaddr_in6* addr) {
+    char tmp[INET6_ADDRSTRLEN];
+    struct timeval tv;
+    int s;
+
     if ((s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
         fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
-        goto done;
+        return -1;
     }
     tv.tv_sec = 0;
     tv.tv_usec = 250 * 1000;
@@ -110,81 +954,596 @@ static void xfer(struct sockaddr_in6* addr, const char* fn) {
         fprintf(stderr, "%s: cannot connect to [%s]%d\n", appname,
                 inet_ntop(AF_INET6, &addr->sin6_addr, tmp, sizeof(tmp)),
                 ntohs(addr->sin6_port));
-        goto done;
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Send all the files, then the boot command.
+static int xfer(session* ss) {
+    char msgbuf[2048];
+    char ackbuf[2048];
+    nbmsg* msg = (void*)msgbuf;
+    nbmsg* ack = (void*)ackbuf;
+    boot_file* files = ss->set->files;
+    uint64_t after = 0;
+    double secs;
+    int i, s, status = -1;
+
+    if ((s = connect_to(&ss->addr)) < 0) {
+        return -1;
     }
 
-    msg->cmd = NB_SEND_FILE;
+    for (i = 0; i < ss->set->file_count; i++) {
+        after += files[i].size;
+    }
+    for (i = 0; i < ss->set->file_count; i++) {
+        after -= files[i].size;
+        fprintf(stderr, "%s: [%s] sending '%s'...\n", appname, ss->name, files[i].fn);
+        if (send_file(s, files + i, ss, after)) {
+            goto done;
+        }
+    }
+    secs = (now_us() - ss->start) / 1000000.0;
+    fprintf(stderr, "%s: [%s] sent %lu bytes in %.2fs, %.1f MB/s\n", appname,
+            ss->name, ss->sent, secs, ss->sent / secs / 1000000.0);
+    if (ss->fec) {
+        fprintf(stderr, "%s: [%s] paced at %.1f MB/s at the end, after %u backoffs\n",
+                appname, ss->name, ss->cc.rate / 1000000.0, ss->cc.backoffs);
+    }
+
+    msg->cmd = NB_BOOT;
     msg->arg = 0;
-    strcpy((void*)msg->data, "kernel.bin");
-    if (io(s, msg, sizeof(nbmsg) + sizeof("kernel.bin"), ack)) {
-        fprintf(stderr, "%s: failed to start transfer\n", appname);
-        goto done;
+    if (io(s, msg, sizeof(nbmsg), ack)) {
+        fprintf(stderr, "%s: [%s] failed to send boot command\n", appname, ss->name);
+    } else {
+        fprintf(stderr, "%s: [%s] sent boot command\n", appname, ss->name);
+        status = 0;
+    }
+done:
+    close(s);
+    return status;
+}
+
+// successful boots by session threads, for -1
+static int boots;
+
+static void* session_thread(void* arg) {
+    session* ss = arg;
+
+    if (xfer(ss) == 0) {
+        __atomic_fetch_add(&boots, 1, __ATOMIC_RELAXED);
     }
+    session_end(ss);
+    return NULL;
+}
+
+// Link benchmark (--bench), to tell a slow NIC driver from a slow
+// protocol.  Payloads match what xfer() sends.
+#define BENCH_PINGS 1000
+#define BENCH_PACKETS 8192
+#define BENCH_PAYLOAD 1024
+#define BENCH_IDLE_US 1000000
+
+// Read and discard anything queued on s.
+static void bench_flush(int s) {
+    char buf[2048];
+    while (recv(s, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        ;
+    }
+}
+
+static int bench_report(int s, nbbench_report* rep) {
+    char msgbuf[2048];
+    char ackbuf[2048];
+    nbmsg* msg = (void*)msgbuf;
+    nbmsg* ack = (void*)ackbuf;
 
-    msg->cmd = NB_DATA;
+    bench_flush(s);
+    msg->cmd = NB_BENCH_REPORT;
     msg->arg = 0;
-    do {
-        r = fread(msg->data, 1, 1024, fp);
-        if (r == 0) {
-            if (ferror(fp)) {
-                fprintf(stderr, "\n%s: error: reading '%s'\n", appname, fn);
-                goto done;
-            }
-            break;
-        }
-        count += r;
-        if (count >= (32 * 1024)) {
-            count = 0;
-            fprintf(stderr, "#");
+    if (io(s, msg, sizeof(nbmsg), ack)) {
+        fprintf(stderr, "%s: no benchmark report\n", appname);
+        return -1;
+    }
+    memcpy(rep, ack->data, sizeof(*rep));
+    return 0;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Round trips, one at a time, with no resends.
+static void bench_ping(int s) {
+    static uint64_t rtt[BENCH_PINGS];
+    char buf[2048];
+    nbmsg msg;
+    nbmsg* ack = (void*)buf;
+    struct pollfd fd;
+    uint64_t t0, t;
+    int i, n = 0, lost = 0;
+
+    fd.fd = s;
+    fd.events = POLLIN;
+    for (i = 0; i < BENCH_PINGS; i++) {
+        msg.magic = NB_MAGIC;
+        msg.cookie = cookie++;
+        msg.cmd = NB_BENCH_PING;
+        msg.arg = i;
+        t0 = now_us();
+        if (write(s, &msg, sizeof(msg)) < 0) {
+            lost++;
+            continue;
         }
-        if (io(s, msg, sizeof(nbmsg) + r, ack)) {
-            fprintf(stderr, "\n%s: error: sending '%s'\n", appname, fn);
-            goto done;
+        for (;;) {
+            t = now_us();
+            if (((t - t0) >= 250000) || (poll(&fd, 1, (250000 - (t - t0)) / 1000 + 1) <= 0)) {
+                lost++;
+                break;
+            }
+            if ((recv(s, buf, sizeof(buf), 0) >= (ssize_t)sizeof(nbmsg)) &&
+                (ack->magic == NB_MAGIC) && (ack->cookie == msg.cookie)) {
+                rtt[n++] = now_us() - t0;
+                break;
+            }
         }
-        msg->arg += r;
-    } while (r != 0);
+    }
+    if (n == 0) {
+        printf("ping:   %d sent, all lost\n", BENCH_PINGS);
+        return;
+    }
+    qsort(rtt, n, sizeof(rtt[0]), cmp_u64);
+    printf("ping:   %d sent, %d lost; rtt p50 %.3f p90 %.3f p99 %.3f max %.3f ms\n",
+           BENCH_PINGS, lost, rtt[n / 2] / 1000.0, rtt[n * 9 / 10] / 1000.0,
+           rtt[n * 99 / 100] / 1000.0, rtt[n - 1] / 1000.0);
+}
 
-    msg->cmd = NB_BOOT;
+static void bench_result(const char* name, uint32_t packets, uint64_t us, unsigned len) {
+    double sec = us / 1e6;
+    printf("%s %u packets in %.3fs: %.2f MB/s, %.0f packets/s", name, packets, sec,
+           (sec > 0) ? (packets * (double)len / sec / (1024 * 1024)) : 0,
+           (sec > 0) ? (packets / sec) : 0);
+}
+
+// NB_DATA into the device's sink: acked one at a time, as xfer()
+// does, then as one unpaced burst.
+static void bench_sink(int s, int burst) {
+    char msgbuf[2048];
+    char ackbuf[2048];
+    nbmsg* msg = (void*)msgbuf;
+    nbmsg* ack = (void*)ackbuf;
+    nbbench_report rep;
+    uint32_t sum = 0;
+    uint64_t t0, t;
+    unsigned timeouts;
+    int i;
+
+    msg->cmd = NB_BENCH_SINK;
     msg->arg = 0;
     if (io(s, msg, sizeof(nbmsg), ack)) {
-        fprintf(stderr, "\n%s: failed to send boot command\n", appname);
+        fprintf(stderr, "%s: device does not support benchmarks\n", appname);
+        return;
+    }
+    timeouts = io_timeouts;
+    t0 = now_us();
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        msg->cmd = NB_DATA;
+        msg->arg = i * BENCH_PAYLOAD;
+        nb_bench_fill(msg->data, BENCH_PAYLOAD, i);
+        sum += nb_bench_sum(msg->data, BENCH_PAYLOAD);
+        if (burst) {
+            msg->magic = NB_MAGIC;
+            msg->cookie = cookie++;
+            if (write(s, msg, sizeof(nbmsg) + BENCH_PAYLOAD) < 0) {
+                // out of socket buffer; let it drain
+                usleep(100);
+            }
+        } else if (io(s, msg, sizeof(nbmsg) + BENCH_PAYLOAD, ack)) {
+            break;
+        }
+    }
+    t = now_us() - t0;
+    if (burst) {
+        // let the device catch up before asking how it did
+        usleep(500000);
+    }
+    if (bench_report(s, &rep)) {
+        return;
+    }
+    if (burst) {
+        bench_result("sink:   burst", BENCH_PACKETS, t, BENCH_PAYLOAD);
+        printf(" offered, %u received (%.1f%% lost)",
+               rep.packets, 100.0 * (BENCH_PACKETS - rep.packets) / BENCH_PACKETS);
     } else {
-        fprintf(stderr, "\n%s: sent boot command\n", appname);
+        bench_result("sink:   acked", rep.packets, t, BENCH_PAYLOAD);
+        printf(", %u resends", io_timeouts - timeouts);
     }
-done:
-    if (s >= 0)
-        close(s);
-    if (fp != NULL)
-        fclose(fp);
+    if (rep.packets == BENCH_PACKETS) {
+        printf(", checksum %s", (rep.sum == sum) ? "ok" : "BAD");
+    }
+    printf("\n");
+}
+
+// NB_BENCH_DATA from the device, as fast as it can send it.
+static void bench_source(int s) {
+    static uint8_t seen[BENCH_PACKETS];
+    char msgbuf[2048];
+    char ackbuf[2048];
+    nbmsg* msg = (void*)msgbuf;
+    nbmsg* ack = (void*)ackbuf;
+    uint8_t want[BENCH_PAYLOAD];
+    nbbench_report rep;
+    struct pollfd fd;
+    uint64_t first = 0, last = 0;
+    uint32_t got = 0, dups = 0, corrupt = 0;
+    ssize_t r;
+
+    memset(seen, 0, sizeof(seen));
+    msg->cmd = NB_BENCH_SOURCE;
+    msg->arg = BENCH_PACKETS;
+    *(uint32_t*)msg->data = BENCH_PAYLOAD;
+    if (io(s, msg, sizeof(nbmsg) + sizeof(uint32_t), ack)) {
+        fprintf(stderr, "%s: device does not support benchmarks\n", appname);
+        return;
+    }
+    fd.fd = s;
+    fd.events = POLLIN;
+    while ((got < BENCH_PACKETS) && (poll(&fd, 1, BENCH_IDLE_US / 1000) > 0)) {
+        if ((r = recv(s, ackbuf, sizeof(ackbuf), 0)) < (ssize_t)sizeof(nbmsg)) {
+            continue;
+        }
+        if ((ack->magic != NB_MAGIC) || (ack->cmd != NB_BENCH_DATA) ||
+            (ack->arg >= BENCH_PACKETS)) {
+            continue;
+        }
+        last = now_us();
+        if (got == 0) {
+            first = last;
+        }
+        if (seen[ack->arg]) {
+            dups++;
+            continue;
+        }
+        seen[ack->arg] = 1;
+        got++;
+        nb_bench_fill(want, BENCH_PAYLOAD, ack->arg);
+        if ((r != (ssize_t)(sizeof(nbmsg) + BENCH_PAYLOAD)) ||
+            memcmp(ack->data, want, BENCH_PAYLOAD)) {
+            corrupt++;
+        }
+    }
+    if (bench_report(s, &rep)) {
+        return;
+    }
+    // the first packet's own time is not measured
+    bench_result("source:", got, last - first, BENCH_PAYLOAD);
+    printf(", %u of %u sent received (%.1f%% lost), %u dups, %u corrupt, %u tx stalls\n",
+           got, rep.sent, rep.sent ? (100.0 * (rep.sent - got) / rep.sent) : 0,
+           dups, corrupt, rep.busy);
+}
+
+static int bench(struct sockaddr_in6* addr) {
+    int s;
+
+    if ((s = connect_to(addr)) < 0) {
+        return -1;
+    }
+    bench_ping(s);
+    bench_sink(s, 0);
+    bench_sink(s, 1);
+    bench_source(s);
+    close(s);
+    return 0;
+}
+
+// Watch mode: files are kept loaded, and reloaded once they have
+// been left alone for SETTLE_MS after a change.  Each complete set
+// is a new build (of its image set), pushed at once to devices of
+// that set beaconing in the last WAITING_MS that have not booted it.
+#define SETTLE_MS 250
+#define WAITING_MS 3000
+#define MAX_DEVICES 16
+
+static int watch_fd = -1;
+static uint64_t settle_at; // when to reload changed files, or 0
+
+static struct {
+    struct sockaddr_in6 addr;
+    uint64_t seen;
+    image_set* set;  // what it is sent, NULL if nothing matches
+    unsigned booted; // build of set last sent to it
+} devices[MAX_DEVICES];
+static int device_count;
+
+static uint64_t now_ms(void) {
+    return now_us() / 1000;
+}
+
+static int watch_init(void) {
+    char dir[4096];
+    boot_file* f;
+    int i, j;
+
+    if ((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s: cannot create inotify instance %d\n", appname, errno);
+        return -1;
+    }
+    // build tools often replace files, so watch their directories
+    for (j = 0; j < set_count; j++) {
+        for (i = 0; i < sets[j].file_count; i++) {
+            f = sets[j].files + i;
+            snprintf(dir, sizeof(dir), "%.*s", (int)(f->base - f->fn), f->fn);
+            f->wd = inotify_add_watch(watch_fd, dir[0] ? dir : ".",
+                                      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if (f->wd < 0) {
+                fprintf(stderr, "%s: cannot watch '%s' %d\n", appname, dir[0] ? dir : ".", errno);
+                return -1;
+            }
+            f->changed = 1;
+        }
+    }
+    settle_at = now_ms();
+    return 0;
+}
+
+static void watch_read(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* ev;
+    boot_file* f;
+    ssize_t r;
+    char* p;
+    int i, j;
+
+    while ((r = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < (buf + r); p += sizeof(*ev) + ev->len) {
+            ev = (void*)p;
+            for (j = 0; j < set_count; j++) {
+                for (i = 0; i < sets[j].file_count; i++) {
+                    f = sets[j].files + i;
+                    if ((ev->wd == f->wd) && ev->len && !strcmp(ev->name, f->base)) {
+                        f->changed = 1;
+                        settle_at = now_ms() + SETTLE_MS;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static int push(int i) {
+    char tmp[INET6_ADDRSTRLEN];
+    image_set* set = devices[i].set;
+    session* ss;
+    int r;
+
+    fprintf(stderr, "%s: pushing build %u of %s to [%s]%d\n", appname, set->build,
+            set->label, inet_ntop(AF_INET6, &devices[i].addr.sin6_addr, tmp, sizeof(tmp)),
+            ntohs(devices[i].addr.sin6_port));
+    if ((ss = session_start(&devices[i].addr, set)) == NULL) {
+        return -1;
+    }
+    r = xfer(ss);
+    session_end(ss);
+    if (r) {
+        return -1;
+    }
+    devices[i].booted = set->build;
+    return 0;
+}
+
+static int build_changing(image_set* set) {
+    int i;
+
+    for (i = 0; i < set->file_count; i++) {
+        if (set->files[i].changed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reload whatever changed; once every file of a set has loaded,
+// that is a new build of it.  Returns 1 if there is a new build.
+static int watch_settle(void) {
+    int i, j, r, changed, waiting = 0, fresh = 0;
+    image_set* set;
+
+    settle_at = 0;
+    for (j = 0; j < set_count; j++) {
+        set = sets + j;
+        changed = 0;
+        for (i = 0; i < set->file_count; i++) {
+            if (!set->files[i].changed) {
+                continue;
+            }
+            changed = 1;
+            if ((r = load_file(set->files + i)) == 0) {
+                set->files[i].changed = 0;
+            } else if (r > 0) {
+                waiting = 1;
+            }
+        }
+        // if still changing, the files are being written, or are
+        // missing until the next change
+        if (!changed || build_changing(set)) {
+            continue;
+        }
+        set->build++;
+        fprintf(stderr, "%s: build %u of %s ready (%s, %zu bytes)\n", appname,
+                set->build, set->label, set->files[set->file_count - 1].fn,
+                set->files[set->file_count - 1].size);
+        fresh = 1;
+    }
+    if (waiting) {
+        settle_at = now_ms() + SETTLE_MS;
+    }
+    return fresh;
+}
+
+// Note a beacon from a device that is to be sent set, returning the
+// index of the device.
+static int device_seen(struct sockaddr_in6* ra, image_set* set) {
+    int i, known;
+
+    for (i = 0; i < device_count; i++) {
+        if (!memcmp(&devices[i].addr.sin6_addr, &ra->sin6_addr, sizeof(ra->sin6_addr))) {
+            break;
+        }
+    }
+    if (!(known = (i < device_count))) {
+        if (device_count == MAX_DEVICES) {
+            // forget the device heard from least recently
+            int j;
+            for (i = 0, j = 1; j < MAX_DEVICES; j++) {
+                if (devices[j].seen < devices[i].seen) {
+                    i = j;
+                }
+            }
+        } else {
+            device_count++;
+        }
+    }
+    if (!known || (devices[i].set != set)) {
+        if (set == NULL) {
+            char tmp[INET6_ADDRSTRLEN];
+            fprintf(stderr, "%s: no image set for [%s]%d\n", appname,
+                    inet_ntop(AF_INET6, &ra->sin6_addr, tmp, sizeof(tmp)),
+                    ntohs(ra->sin6_port));
+        }
+        devices[i].set = set;
+        devices[i].booted = 0;
+    }
+    devices[i].addr = *ra;
+    devices[i].seen = now_ms();
+    return i;
 }
 
 void usage(void) {
     fprintf(stderr,
-            "usage:   %s [ <option> ]* <filename>\n"
+            "usage:   %s [ <option> ]* [ <filename> ]\n"
+            "         %s --bench\n"
             "\n"
-            "options: -1  only boot once, then exit\n",
-            appname);
+            "options: -1  exit after the first successful boot\n"
+            "         -l <dir>  save device logs to <dir>/<address>.log\n"
+            "         -r <ramdisk>  send a ramdisk with the kernel\n"
+            "         -c <cmdline>  send a kernel command line\n"
+            "         -m <manifest>  send a boot manifest (see mkmanifest)\n"
+            "         -i <imagemap>  send each device the files of the first\n"
+            "             line of <imagemap> its beacon matches, such as\n"
+            "               board=NUC7i5DNB kernel.bin=nuc.bin ramdisk.bin=nuc.rd\n"
+            "               mac=02:4e:42:00:00:02 kernel.bin=qemu.bin cmdline=qc\n"
+            "             (keys are serialno, board and mac); devices that\n"
+            "             match no line get the files given above, if any\n"
+            "         -f <k>/<m>  send data in groups of k blocks with m\n"
+            "             parity blocks, which the device rebuilds lost\n"
+            "             blocks from (k up to %d, m up to %d; try 32/2),\n"
+            "             paced to what the device and link can take\n"
+            "         -b <MB/s>  share this much bandwidth among the devices\n"
+            "             being sent to at once\n"
+            "         -d <MB/s>  send to each device at no more than this\n"
+            "         -p fair|srpt  share -b evenly (the default), or\n"
+            "             shortest remaining transfer first\n"
+            "         -w  watch the files, and push each new build to\n"
+            "             waiting devices as soon as it is written\n"
+            "         --bench  measure the link to the first device heard\n"
+            "             from (round trips, sink and source throughput)\n",
+            appname, appname, NB_FEC_MAX_K, NB_FEC_MAX_M);
     exit(1);
 }
 
+// Ask the devices on every link to advertise themselves now, rather
+// than waiting up to a second for their next beacon.  The answers
+// come back to s like beacons.
+static void query(int s) {
+    struct ifaddrs* ifa;
+    struct ifaddrs* i;
+    struct sockaddr_in6 addr;
+    unsigned sent[64];
+    unsigned n = 0, j, index;
+    nbmsg msg;
+
+    if (getifaddrs(&ifa)) {
+        return;
+    }
+    msg.magic = NB_MAGIC;
+    msg.cookie = __atomic_fetch_add(&cookie, 1, __ATOMIC_RELAXED);
+    msg.cmd = NB_QUERY;
+    msg.arg = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(NB_SERVER_PORT);
+    inet_pton(AF_INET6, "ff02::1", &addr.sin6_addr);
+    for (i = ifa; i; i = i->ifa_next) {
+        if ((i->ifa_addr == NULL) || (i->ifa_addr->sa_family != AF_INET6) ||
+            ((i->ifa_flags & (IFF_UP | IFF_MULTICAST | IFF_LOOPBACK)) != (IFF_UP | IFF_MULTICAST))) {
+            continue;
+        }
+        if ((index = if_nametoindex(i->ifa_name)) == 0) {
+            continue;
+        }
+        for (j = 0; (j < n) && (sent[j] != index); j++)
+            ;
+        if ((j < n) || (n == (sizeof(sent) / sizeof(sent[0])))) {
+            continue;
+        }
+        sent[n++] = index;
+        addr.sin6_scope_id = index;
+        sendto(s, &msg, sizeof(msg), 0, (void*)&addr, sizeof(addr));
+    }
+    freeifaddrs(ifa);
+}
+
+// Discard stale beacons, but keep any logs that arrived meanwhile.
 void drain(int fd) {
+    struct sockaddr_in6 ra;
+    socklen_t rlen;
     char buf[4096];
+    nbmsg* msg = (void*)buf;
+    ssize_t r;
     if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
-        while (read(fd, buf, sizeof(buf)) > 0)
-            ;
+        for (;;) {
+            rlen = sizeof(ra);
+            if ((r = recvfrom(fd, buf, sizeof(buf), 0, (void*)&ra, &rlen)) <= 0) {
+                break;
+            }
+            if ((r >= sizeof(nbmsg)) && (msg->magic == NB_MAGIC) && (msg->cmd == NB_LOG)) {
+                save_log(&ra, msg, r - sizeof(nbmsg));
+            }
+        }
         fcntl(fd, F_SETFL, 0);
     }
 }
 
+// how often to report on concurrent sessions
+#define REPORT_MS 1000
+
 int main(int argc, char** argv) {
     struct sockaddr_in6 addr;
     char tmp[INET6_ADDRSTRLEN];
     int r, s, n = 1;
     const char* fn = NULL;
+    const char* ramdisk_fn = NULL;
+    const char* cmdline_fn = NULL;
+    const char* manifest_fn = NULL;
+    const char* map_fn = NULL;
+    image_set* set;
     int once = 0;
+    int watch = 0;
+    int benchmark = 0;
+    uint64_t reported = 0;
+    session* ss;
+    pthread_t thread;
+    int i;
 
     appname = argv[0];
 
+    // a restarted server must not look like a resend of the old one
+    cookie = time(NULL) ^ (getpid() << 16);
+
     while (argc > 1) {
         if (argv[1][0] != '-') {
             if (fn != NULL)
@@ -192,15 +1551,89 @@ int main(int argc, char** argv) {
             fn = argv[1];
         } else if (!strcmp(argv[1], "-1")) {
             once = 1;
+        } else if (!strcmp(argv[1], "-w")) {
+            watch = 1;
+        } else if (!strcmp(argv[1], "--bench")) {
+            benchmark = 1;
+        } else if (!strcmp(argv[1], "-f") && (argc > 2)) {
+            if ((sscanf(argv[2], "%u/%u", &fec_k, &fec_m) != 2) ||
+                (fec_k < 1) || (fec_k > NB_FEC_MAX_K) ||
+                (fec_m < 1) || (fec_m > NB_FEC_MAX_M) || (fec_m > fec_k)) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-b") && (argc > 2)) {
+            if ((sched_budget = strtod(argv[2], NULL) * 1000000.0) <= 0) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-d") && (argc > 2)) {
+            if ((sched_cap = strtod(argv[2], NULL) * 1000000.0) <= 0) {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-p") && (argc > 2)) {
+            if (!strcmp(argv[2], "fair")) {
+                sched_policy = SCHED_FAIR;
+            } else if (!strcmp(argv[2], "srpt")) {
+                sched_policy = SCHED_SRPT;
+            } else {
+                usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-l") && (argc > 2)) {
+            logdir = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-r") && (argc > 2)) {
+            ramdisk_fn = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-c") && (argc > 2)) {
+            cmdline_fn = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-m") && (argc > 2)) {
+            manifest_fn = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-i") && (argc > 2)) {
+            map_fn = argv[2];
+            argc--;
+            argv++;
         } else {
             usage();
         }
         argc--;
         argv++;
     }
-    if (fn == NULL) {
+    if ((fn == NULL) && ((map_fn == NULL) || ramdisk_fn || cmdline_fn || manifest_fn) &&
+        !benchmark) {
         usage();
     }
+    snprintf(sets[0].label, sizeof(sets[0].label), "default");
+    if (fn) {
+        if (manifest_fn) {
+            add_file(sets, "manifest", manifest_fn);
+        }
+        if (cmdline_fn) {
+            add_file(sets, "cmdline", cmdline_fn);
+        }
+        if (ramdisk_fn) {
+            add_file(sets, "ramdisk.bin", ramdisk_fn);
+        }
+        add_file(sets, "kernel.bin", fn);
+    }
+    if (map_fn && load_map(map_fn)) {
+        return -1;
+    }
+    if (watch && !benchmark && watch_init()) {
+        return -1;
+    }
 
     memset(&addr, 0, sizeof(addr));
     addr.sin6_family = AF_INET6;
@@ -222,13 +1655,79 @@ int main(int argc, char** argv) {
     fprintf(stderr, "%s: listening on [%s]%d\n", appname,
             inet_ntop(AF_INET6, &addr.sin6_addr, tmp, sizeof(tmp)),
             ntohs(addr.sin6_port));
+    query(s);
     for (;;) {
         struct sockaddr_in6 ra;
         socklen_t rlen;
         char buf[4096];
         nbmsg* msg = (void*)buf;
+        struct pollfd fds[2];
+        int timeout = -1;
+
+        if (watch) {
+            if (settle_at) {
+                uint64_t t = now_ms();
+                if (t >= settle_at) {
+                    if (watch_settle()) {
+                        // a new build: push it to anyone waiting
+                        for (i = 0; i < device_count; i++) {
+                            set = devices[i].set;
+                            if (set && set->build && !build_changing(set) &&
+                                (devices[i].booted != set->build) &&
+                                ((t - devices[i].seen) < WAITING_MS)) {
+                                if ((push(i) == 0) && once) {
+                                    return 0;
+                                }
+                            }
+                        }
+                        drain(s);
+                        // and have anyone else say they are there too
+                        query(s);
+                    }
+                    continue;
+                }
+                timeout = settle_at - t;
+            }
+        }
+        if (once && __atomic_load_n(&boots, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (__atomic_load_n(&sessions_active, __ATOMIC_RELAXED) > 1) {
+            // several devices at once: report how they are doing
+            uint64_t t = now_us();
+            if ((t - reported) >= (REPORT_MS * 1000)) {
+                if (reported) {
+                    sched_report(t - reported);
+                }
+                reported = t;
+            }
+            timeout = REPORT_MS;
+        } else {
+            reported = 0;
+            if (__atomic_load_n(&sessions_active, __ATOMIC_RELAXED)) {
+                timeout = REPORT_MS;
+            }
+        }
+        fds[0].fd = s;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, watch ? 2 : 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: poll error %d\n", appname, errno);
+            break;
+        }
+        if (watch && (fds[1].revents & POLLIN)) {
+            watch_read();
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
         rlen = sizeof(ra);
-        r = recvfrom(s, buf, 4096, 0, (void*)&ra, &rlen);
+        r = recvfrom(s, buf, sizeof(buf) - 1, 0, (void*)&ra, &rlen);
         if (r < 0) {
             fprintf(stderr, "%s: socket read error %d\n", appname, r);
             break;
@@ -241,14 +1740,63 @@ int main(int argc, char** argv) {
         }
         if (msg->magic != NB_MAGIC)
             continue;
+        if (msg->cmd == NB_LOG) {
+            save_log(&ra, msg, r - sizeof(nbmsg));
+            continue;
+        }
         if (msg->cmd != NB_ADVERTISE)
             continue;
-        fprintf(stderr, "%s: got beacon from [%s]%d\n", appname,
-                inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
-                ntohs(ra.sin6_port));
-        fprintf(stderr, "%s: sending '%s'...\n", appname, fn);
-        xfer(&ra, fn);
-        if (once) {
+        if (benchmark) {
+            fprintf(stderr, "%s: benchmarking [%s]%d\n", appname,
+                    inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
+                    ntohs(ra.sin6_port));
+            return bench(&ra) ? 1 : 0;
+        }
+        buf[r] = 0;
+        set = match_set((char*)msg->data, r - sizeof(nbmsg));
+        i = device_seen(&ra, set);
+        if (set == NULL) {
+            continue;
+        }
+        if (watch) {
+            // a device gets each build once; after that it
+            // waits for the next one
+            if ((set->build == 0) || build_changing(set) || (devices[i].booted == set->build)) {
+                continue;
+            }
+            fprintf(stderr, "%s: got beacon from [%s]%d%s%s\n", appname,
+                    inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
+                    ntohs(ra.sin6_port), set->key ? ", " : "", set->key ? set->label : "");
+            r = push(i);
+        } else {
+            // each device gets a session of its own, on its own thread;
+            // one whose transfer is unfinished resumes on its next beacon
+            if (__atomic_load_n(&set->users, __ATOMIC_RELAXED) == 0) {
+                // pick up new files only when nothing is using the old ones
+                for (i = 0; i < set->file_count; i++) {
+                    if (file_stale(set->files + i) && load_file(set->files + i)) {
+                        break;
+                    }
+                }
+                if (i < set->file_count) {
+                    continue;
+                }
+            }
+            if ((ss = session_start(&ra, set)) == NULL) {
+                continue;
+            }
+            fprintf(stderr, "%s: got beacon from [%s]%d%s%s\n", appname,
+                    inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
+                    ntohs(ra.sin6_port), set->key ? ", " : "", set->key ? set->label : "");
+            if (pthread_create(&thread, NULL, session_thread, ss)) {
+                fprintf(stderr, "%s: cannot start a session\n", appname);
+                session_end(ss);
+                continue;
+            }
+            pthread_detach(thread);
+            continue;
+        }
+        if (once && (r == 0)) {
             break;
         }
         drain(s);
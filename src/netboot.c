@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,6 +32,331 @@ static int nb_active = 0;
 // item being downloaded
 static nbfile* item;
 
+// files being (or already) received, by name, so that a transfer
+// cut short can carry on where it left off
+#define NB_MAX_FILES 4
+#define NB_NAME_LEN 32
+
+static struct {
+    char name[NB_NAME_LEN];
+    uint8_t ident[NB_IDENT_LEN];
+    uint32_t size;
+    nbfile* file;
+} nb_files[NB_MAX_FILES];
+
+// Find (or, with ident, make) the entry for name.
+static int nb_file_slot(const char* name) {
+    int i, free_slot = -1;
+
+    for (i = 0; i < NB_MAX_FILES; i++) {
+        if (nb_files[i].file == 0) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+        } else if (!strcmp(nb_files[i].name, name)) {
+            return i;
+        }
+    }
+    return free_slot;
+}
+
+// FEC group being received (NB_FEC_DATA, NB_FEC_PARITY), staged
+// until every block is in, by arrival or rebuilt from the parity.
+// It always starts at item->offset; len is 0 until a parity block
+// says how big the group is.
+static struct {
+    size_t base;
+    uint32_t len;
+    uint32_t k;
+    uint32_t m;
+    uint64_t have;   // data blocks in
+    uint32_t parity; // parity blocks in
+} nb_fec;
+static uint64_t nb_fec_data[NB_FEC_MAX_K][NB_FEC_BLOCK / 8];
+static uint64_t nb_fec_parity[NB_FEC_MAX_M][NB_FEC_BLOCK / 8];
+
+static void nb_fec_reset(void) {
+    nb_fec.base = item ? item->offset : 0;
+    nb_fec.len = 0;
+    nb_fec.have = 0;
+    nb_fec.parity = 0;
+}
+
+// Start receiving name, resuming if the device already has part of
+// a file with the same identity.  Returns the offset to send from,
+// or -1 if the file is not wanted.
+static int64_t nb_file_start(const char* name, uint32_t size, const uint8_t* ident) {
+    int i = nb_file_slot(name);
+
+    nb_fec_reset();
+
+    if ((i >= 0) && nb_files[i].file && ident &&
+        !memcmp(nb_files[i].ident, ident, NB_IDENT_LEN) && (nb_files[i].size == size)) {
+        item = nb_files[i].file;
+        return item->offset;
+    }
+    if (i >= 0) {
+        nb_files[i].file = 0;
+    }
+    // servers that resume always announce the size; older ones
+    // sending NB_SEND_FILE may send 0 instead
+    item = netboot_get_buffer(name, size, (ident != 0) || (size != 0));
+    if (item == 0) {
+        return -1;
+    }
+    item->offset = 0;
+    if ((i >= 0) && ident && (strlen(name) < NB_NAME_LEN)) {
+        memcpy(nb_files[i].name, name, strlen(name) + 1);
+        memcpy(nb_files[i].ident, ident, NB_IDENT_LEN);
+        nb_files[i].size = size;
+        nb_files[i].file = item;
+    }
+    return 0;
+}
+
+// Make a received file name printable, in place.
+static void nb_file_name(uint8_t* name, size_t len) {
+    name[len - 1] = 0;
+    for (size_t i = 0; i < (len - 1); i++) {
+        if ((name[i] < ' ') || (name[i] > 127)) {
+            name[i] = '.';
+        }
+    }
+}
+
+// benchmark state: a sink for NB_DATA, and a source of NB_BENCH_DATA
+static int nb_sinking = 0;
+static nbbench_report nb_bench;
+static uint32_t nb_source_count;
+static uint32_t nb_source_len;
+static ip6_addr nb_source_addr;
+static uint16_t nb_source_port;
+
+// where to send the log, once a server has talked to us
+static ip6_addr nb_server_addr;
+static int nb_server_known = 0;
+
+static uint32_t nbfile_store(nbfile* f, const uint8_t* data, size_t len) {
+    const uint8_t* in = data;
+    size_t in_len = len;
+    size_t off = f->offset;
+    size_t n;
+
+    if ((f->tail == 0) || (off < f->split)) {
+        n = len;
+        if (f->tail && ((off + n) > f->split)) {
+            n = f->split - off;
+        }
+        if ((off + n) > f->size) {
+            return NB_ERROR_TOO_LARGE;
+        }
+        memcpy(f->data + off, data, n);
+        off += n;
+        data += n;
+        len -= n;
+    }
+    if (len) {
+        if ((off - f->split + len) > f->tail_size) {
+            return NB_ERROR_TOO_LARGE;
+        }
+        memcpy(f->tail + (off - f->split), data, len);
+        off += len;
+    }
+    f->offset = off;
+    if (f->stored) {
+        f->stored(f, in, in_len);
+    }
+
+    if (f->header && (f->offset >= f->header)) {
+        f->header = 0;
+        if (netboot_file_header(f)) {
+            return NB_ERROR_BAD_FILE;
+        }
+        // move anything received past the new split point
+        if (f->tail && (f->offset > f->split)) {
+            memcpy(f->tail, f->data + f->split, f->offset - f->split);
+        }
+    }
+    return NB_ACK;
+}
+
+void netboot_forget_files(void) {
+    memset(nb_files, 0, sizeof(nb_files));
+    item = 0;
+    nb_fec_reset();
+}
+
+// Forget a file whose contents were refused.
+static void nb_file_reject(void) {
+    printf("netboot: Rejected File contents\n");
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        if (nb_files[i].file == item) {
+            nb_files[i].file = 0;
+        }
+    }
+    item = 0;
+}
+
+// Rebuild what the parity allows.  Returns the blocks still missing.
+static uint64_t nb_fec_rebuild(void) {
+    uint64_t all = (nb_fec.k == 64) ? ~0ULL : ((1ULL << nb_fec.k) - 1);
+    uint64_t missing = all & ~nb_fec.have;
+    uint32_t i, j, lost, count;
+
+    for (j = 0; (j < nb_fec.m) && missing; j++) {
+        if (!(nb_fec.parity & (1U << j))) {
+            continue;
+        }
+        lost = 0;
+        count = 0;
+        for (i = j; i < nb_fec.k; i += nb_fec.m) {
+            if (missing & (1ULL << i)) {
+                lost = i;
+                count++;
+            }
+        }
+        if (count != 1) {
+            continue;
+        }
+        memcpy(nb_fec_data[lost], nb_fec_parity[j], NB_FEC_BLOCK);
+        for (i = j; i < nb_fec.k; i += nb_fec.m) {
+            if (i != lost) {
+                for (int w = 0; w < (NB_FEC_BLOCK / 8); w++) {
+                    nb_fec_data[lost][w] ^= nb_fec_data[i][w];
+                }
+            }
+        }
+        nb_fec.have |= 1ULL << lost;
+        missing &= ~(1ULL << lost);
+    }
+    return missing;
+}
+
+// Stage an FEC block, and answer once the group is in (or, at its
+// last parity block, is still not).  Acks are not remembered for
+// resends like other commands': the last parity block is what the
+// server resends, and it is always answered.
+static void nb_fec_recv(nbmsg* msg, size_t len, const ip6_addr* saddr, uint16_t sport) {
+    uint8_t buffer[sizeof(nbmsg) + sizeof(uint64_t)];
+    nbmsg* ack = (void*)buffer;
+    size_t ack_len = sizeof(nbmsg);
+    nbfec_hdr* hdr = (void*)msg->data;
+    uint64_t missing;
+    uint32_t i, n;
+    int last = 0;
+
+    nb_active = 1;
+    if (item == 0)
+        return;
+
+    ack->magic = NB_MAGIC;
+    ack->cookie = msg->cookie;
+    ack->cmd = NB_ACK;
+
+    if (msg->cmd == NB_FEC_DATA) {
+        if ((msg->arg < item->offset) || (len > NB_FEC_BLOCK))
+            return;
+        i = (msg->arg - item->offset) / NB_FEC_BLOCK;
+        if (((msg->arg - item->offset) % NB_FEC_BLOCK) || (i >= NB_FEC_MAX_K))
+            return;
+        if (nb_fec.base != item->offset) {
+            nb_fec_reset();
+        }
+        // parity covers the short last block as if zero padded
+        memcpy(nb_fec_data[i], msg->data, len);
+        memset((uint8_t*)nb_fec_data[i] + len, 0, NB_FEC_BLOCK - len);
+        nb_fec.have |= 1ULL << i;
+    } else {
+        if (len != (sizeof(nbfec_hdr) + NB_FEC_BLOCK))
+            return;
+        if ((hdr->k == 0) || (hdr->k > NB_FEC_MAX_K) || (hdr->m == 0) ||
+            (hdr->m > NB_FEC_MAX_M) || (hdr->m > hdr->k) || (hdr->index >= hdr->m) ||
+            (hdr->len > (hdr->k * NB_FEC_BLOCK)) || (hdr->len <= ((hdr->k - 1) * NB_FEC_BLOCK)))
+            return;
+        last = (hdr->index == (hdr->m - 1));
+        if (msg->arg != item->offset) {
+            // a group already in: its ack may have been lost
+            if (last && (msg->arg < item->offset)) {
+                ack->arg = item->offset;
+                udp6_send(buffer, ack_len, saddr, sport, NB_SERVER_PORT);
+            }
+            return;
+        }
+        if ((nb_fec.base != item->offset) || (nb_fec.k != hdr->k) ||
+            (nb_fec.m != hdr->m) || (nb_fec.len != hdr->len)) {
+            // staged data blocks are still good, but not the parity
+            if (nb_fec.base != item->offset) {
+                nb_fec_reset();
+            }
+            nb_fec.parity = 0;
+            nb_fec.k = hdr->k;
+            nb_fec.m = hdr->m;
+            nb_fec.len = hdr->len;
+        }
+        memcpy(nb_fec_parity[hdr->index], msg->data + sizeof(nbfec_hdr), NB_FEC_BLOCK);
+        nb_fec.parity |= 1U << hdr->index;
+    }
+
+    if (nb_fec.len == 0)
+        return;
+    if ((missing = nb_fec_rebuild()) == 0) {
+        for (i = 0; i < nb_fec.k; i++) {
+            n = nb_fec.len - (i * NB_FEC_BLOCK);
+            if (n > NB_FEC_BLOCK) {
+                n = NB_FEC_BLOCK;
+            }
+            if ((ack->cmd = nbfile_store(item, (void*)nb_fec_data[i], n)) != NB_ACK) {
+                break;
+            }
+        }
+        ack->arg = item->offset;
+        if (ack->cmd == NB_ERROR_BAD_FILE) {
+            nb_file_reject();
+        }
+        nb_fec_reset();
+    } else if (last) {
+        ack->arg = item->offset;
+        memcpy(ack->data, &missing, sizeof(missing));
+        ack_len += sizeof(missing);
+    } else {
+        return;
+    }
+    udp6_send(buffer, ack_len, saddr, sport, NB_SERVER_PORT);
+}
+
+// beacon contents, "key\0value\0" pairs (see netboot_init)
+static char advertise_data[NB_ADVERT_MAX];
+static size_t advertise_len;
+
+static char nb_serialno[NB_IDENT_MAX] = "unknown";
+static char nb_board[NB_IDENT_MAX] = "unknown";
+
+static void advertise_add(const char* key, const char* value) {
+    size_t klen = strlen(key) + 1;
+    size_t vlen = strlen(value) + 1;
+
+    if ((advertise_len + klen + vlen) > sizeof(advertise_data)) {
+        return;
+    }
+    memcpy(advertise_data + advertise_len, key, klen);
+    advertise_len += klen;
+    memcpy(advertise_data + advertise_len, value, vlen);
+    advertise_len += vlen;
+}
+
+// Beacon to all nodes, or answer an NB_QUERY from addr.
+static void advertise(const ip6_addr* addr, uint16_t port) {
+    uint8_t buffer[sizeof(nbmsg) + NB_ADVERT_MAX];
+    nbmsg* msg = (void*)buffer;
+    msg->magic = NB_MAGIC;
+    msg->cookie = 0;
+    msg->cmd = NB_ADVERTISE;
+    msg->arg = 0;
+    memcpy(msg->data, advertise_data, advertise_len);
+    udp6_send(buffer, sizeof(nbmsg) + advertise_len,
+              addr, port, NB_SERVER_PORT);
+}
+
 void udp6_recv(void* data, size_t len,
                const ip6_addr* daddr, uint16_t dport,
                const ip6_addr* saddr, uint16_t sport) {
@@ -47,8 +373,25 @@ void udp6_recv(void* data, size_t len,
     //printf("netboot: MSG %08x %08x %08x %08x datalen %d\n",
     //	msg->magic, msg->cookie, msg->cmd, msg->arg, len);
 
+    if ((msg->magic == NB_MAGIC) && (msg->cmd == NB_QUERY)) {
+        // a server looking for devices: no need to wait for a beacon
+        advertise(saddr, sport);
+        return;
+    }
+    // nothing else is addressed to all nodes
+    if (daddr->x[0] == 0xFF)
+        return;
+
+    if ((msg->magic == NB_MAGIC) &&
+        ((msg->cmd == NB_FEC_DATA) || (msg->cmd == NB_FEC_PARITY))) {
+        nb_server_addr = *saddr;
+        nb_server_known = 1;
+        nb_fec_recv(msg, len, saddr, sport);
+        return;
+    }
+
     if ((last_cookie == msg->cookie) &&
-        (last_cmd == msg->cmd) && (last_arg = msg->arg)) {
+        (last_cmd == msg->cmd) && (last_arg == msg->arg)) {
         // host must have missed the ack. resend
         ack.magic = NB_MAGIC;
         ack.cookie = last_cookie;
@@ -60,6 +403,15 @@ void udp6_recv(void* data, size_t len,
     ack.cmd = NB_ACK;
     ack.arg = 0;
 
+    if (msg->magic == NB_MAGIC) {
+        nb_server_addr = *saddr;
+        nb_server_known = 1;
+    }
+
+    if (msg->cmd != NB_DATA) {
+        nb_sinking = 0;
+    }
+
     switch (msg->cmd) {
     case NB_COMMAND:
         if (len == 0)
@@ -69,35 +421,87 @@ void udp6_recv(void* data, size_t len,
     case NB_SEND_FILE:
         if (len == 0)
             return;
-        msg->data[len - 1] = 0;
-        for (int i = 0; i < (len - 1); i++) {
-            if ((msg->data[i] < ' ') || (msg->data[i] > 127)) {
-                msg->data[i] = '.';
-            }
-        }
-        item = netboot_get_buffer((const char*) msg->data);
-        if (item) {
-            item->offset = 0;
+        nb_file_name(msg->data, len);
+        ack.arg = msg->arg;
+        if (nb_file_start((const char*) msg->data, msg->arg, 0) == 0) {
             printf("netboot: Receive File '%s'...\n", (char*) msg->data);
         } else {
             printf("netboot: Rejected File '%s'...\n", (char*) msg->data);
             ack.cmd = NB_ERROR_BAD_FILE;
         }
         break;
+    case NB_RESUME_FILE: {
+        int64_t off;
+        if (len <= NB_IDENT_LEN)
+            return;
+        nb_file_name(msg->data + NB_IDENT_LEN, len - NB_IDENT_LEN);
+        off = nb_file_start((const char*) msg->data + NB_IDENT_LEN, msg->arg, msg->data);
+        if (off > 0) {
+            printf("netboot: Resume File '%s' at %ld...\n",
+                   (char*) msg->data + NB_IDENT_LEN, off);
+            ack.arg = off;
+        } else if (off == 0) {
+            printf("netboot: Receive File '%s'...\n", (char*) msg->data + NB_IDENT_LEN);
+        } else {
+            printf("netboot: Rejected File '%s'...\n", (char*) msg->data + NB_IDENT_LEN);
+            ack.cmd = NB_ERROR_BAD_FILE;
+        }
+        break;
+    }
     case NB_DATA:
+        if (nb_sinking) {
+            nb_bench.packets++;
+            nb_bench.bytes += len;
+            nb_bench.sum += nb_bench_sum(msg->data, len);
+            ack.arg = msg->arg;
+            break;
+        }
         if (item == 0)
             return;
         if (msg->arg != item->offset)
             return;
         ack.arg = msg->arg;
-        if ((item->offset + len) > item->size) {
-            ack.cmd = NB_ERROR_TOO_LARGE;
-        } else {
-            memcpy(item->data + item->offset, msg->data, len);
-            item->offset += len;
-            ack.cmd = NB_ACK;
+        ack.cmd = nbfile_store(item, msg->data, len);
+        if (ack.cmd == NB_ERROR_BAD_FILE) {
+            nb_file_reject();
+        }
+        break;
+    case NB_BENCH_SINK:
+        nb_sinking = 1;
+        nb_bench.packets = 0;
+        nb_bench.bytes = 0;
+        nb_bench.sum = 0;
+        break;
+    case NB_BENCH_SOURCE:
+        if ((len < sizeof(uint32_t)) || (*(uint32_t*)msg->data > NB_BENCH_MAX)) {
+            ack.cmd = NB_ERROR_BAD_PARAM;
+            break;
         }
+        // sent from netboot_poll(), as transmit buffers allow
+        nb_source_len = *(uint32_t*)msg->data;
+        nb_source_count = msg->arg;
+        nb_source_addr = *saddr;
+        nb_source_port = sport;
+        nb_bench.sent = 0;
+        nb_bench.busy = 0;
+        ack.arg = msg->arg;
         break;
+    case NB_BENCH_PING:
+        ack.arg = msg->arg;
+        break;
+    case NB_BENCH_REPORT: {
+        uint8_t buffer[sizeof(nbmsg) + sizeof(nbbench_report)];
+        nbmsg* reply = (void*)buffer;
+        // not remembered for resends: it is safe to answer again
+        reply->magic = NB_MAGIC;
+        reply->cookie = msg->cookie;
+        reply->cmd = NB_ACK;
+        reply->arg = 0;
+        memcpy(reply->data, &nb_bench, sizeof(nb_bench));
+        nb_active = 1;
+        udp6_send(buffer, sizeof(buffer), saddr, sport, NB_SERVER_PORT);
+        return;
+    }
     case NB_BOOT:
         nb_boot_now = 1;
         printf("netboot: Boot Kernel...\n");
@@ -120,45 +524,143 @@ transmit:
     udp6_send(&ack, sizeof(ack), saddr, sport, NB_SERVER_PORT);
 }
 
-static char advertise_data[] =
-    "version\00.1\0"
-    "serialno\0unknown\0"
-    "board\0unknown\0";
+// log text per message, messages per timer tick, and the most
+// netboot_close() sends before giving up on the rest
+#define NB_LOG_MAX 1024
+#define NB_LOG_BURST 16
+#define NB_LOG_CLOSE_MAX (256 * 1024)
+
+static size_t (*nb_log_read)(uint64_t* offset, void* data, size_t len);
+static uint64_t nb_log_offset;
+
+void netboot_set_log(size_t (*read)(uint64_t* offset, void* data, size_t len)) {
+    nb_log_read = read;
+}
 
-static void advertise(void) {
-    uint8_t buffer[256];
+// Send up to *budget bytes of the log not yet sent, deducting what
+// goes out.  Text is only counted as sent once udp6_send() takes it.
+// Returns nonzero if some remains (the budget ran out, or the NIC is
+// out of transmit buffers).
+static int send_log(size_t* budget) {
+    uint8_t buffer[sizeof(nbmsg) + NB_LOG_MAX];
     nbmsg* msg = (void*)buffer;
-    msg->magic = NB_MAGIC;
-    msg->cookie = 0;
-    msg->cmd = NB_ADVERTISE;
-    msg->arg = 0;
-    memcpy(msg->data, advertise_data, sizeof(advertise_data));
-    udp6_send(buffer, sizeof(nbmsg) + sizeof(advertise_data),
-              &ip6_ll_all_nodes, NB_ADVERT_PORT, NB_SERVER_PORT);
+    uint64_t off;
+    size_t n;
+
+    if (nb_log_read == 0) {
+        return 0;
+    }
+    while (*budget) {
+        off = nb_log_offset;
+        n = (*budget < NB_LOG_MAX) ? *budget : NB_LOG_MAX;
+        if ((n = nb_log_read(&off, msg->data, n)) == 0) {
+            return 0;
+        }
+        msg->magic = NB_MAGIC;
+        msg->cookie = 0;
+        msg->cmd = NB_LOG;
+        msg->arg = off;
+        if (udp6_send(buffer, sizeof(nbmsg) + n,
+                      nb_server_known ? &nb_server_addr : &ip6_ll_all_nodes,
+                      NB_ADVERT_PORT, NB_SERVER_PORT)) {
+            return 1;
+        }
+        nb_log_offset = off + n;
+        *budget -= n;
+    }
+    return 1;
+}
+
+// Send what remains of an NB_BENCH_SOURCE burst, until the
+// NIC runs out of transmit buffers.
+static void send_source(void) {
+    uint8_t buffer[sizeof(nbmsg) + NB_BENCH_MAX];
+    nbmsg* msg = (void*)buffer;
+
+    while (nb_bench.sent < nb_source_count) {
+        msg->magic = NB_MAGIC;
+        msg->cookie = 0;
+        msg->cmd = NB_BENCH_DATA;
+        msg->arg = nb_bench.sent;
+        nb_bench_fill(msg->data, nb_source_len, nb_bench.sent);
+        if (udp6_send(buffer, sizeof(nbmsg) + nb_source_len,
+                      &nb_source_addr, nb_source_port, NB_SERVER_PORT)) {
+            nb_bench.busy++;
+            return;
+        }
+        nb_bench.sent++;
+        nb_active = 1;
+    }
 }
 
 #define FAST_TICK 100
 #define SLOW_TICK 1000
 
+// how often to summarize dropped packets
+#define REPORT_MS 5000
+
+// Copy an identity string, trimmed, with any blanks inside turned
+// to '_' so that it is a single word for nbserver.
+static void ident_copy(char* out, const char* in) {
+    size_t n = 0;
+
+    while ((*in == ' ') || (*in == '\t')) {
+        in++;
+    }
+    for (; *in && (n < (NB_IDENT_MAX - 1)); in++) {
+        out[n++] = ((*in == ' ') || (*in == '\t')) ? '_' : *in;
+    }
+    // firmware strings are often padded
+    while (n && (out[n - 1] == '_')) {
+        n--;
+    }
+    out[n] = 0;
+    if (n == 0) {
+        memcpy(out, "unknown", 8);
+    }
+}
+
+void netboot_set_identity(const char* serialno, const char* board) {
+    if (serialno) {
+        ident_copy(nb_serialno, serialno);
+    }
+    if (board) {
+        ident_copy(nb_board, board);
+    }
+}
+
 int netboot_init(void) {
+    char mac[18];
+
     if (netifc_open()) {
         printf("netboot: Failed to open network interface\n");
         return -1;
     }
+    snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+             ll_mac_addr.x[0], ll_mac_addr.x[1], ll_mac_addr.x[2],
+             ll_mac_addr.x[3], ll_mac_addr.x[4], ll_mac_addr.x[5]);
+    advertise_len = 0;
+    advertise_add("version", "0.1");
+    advertise_add("serialno", nb_serialno);
+    advertise_add("board", nb_board);
+    advertise_add("mac", mac);
     return 0;
 }
 
 static int nb_fastcount = 0;
 static int nb_online = 0;
+static uint32_t nb_report_ms = 0;
 
 int netboot_poll(void) {
+    size_t budget;
+
     if (netifc_active()) {
         if (nb_online == 0) {
             printf("netboot: interface online\n");
             nb_online = 1;
             nb_fastcount = 20;
             netifc_set_timer(FAST_TICK);
-            advertise();
+            advertise(&ip6_ll_all_nodes, NB_ADVERT_PORT);
         }
     } else {
         if (nb_online == 1) {
@@ -170,19 +672,28 @@ int netboot_poll(void) {
     if (netifc_timer_expired()) {
         if (nb_fastcount) {
             nb_fastcount--;
+            nb_report_ms += FAST_TICK;
             netifc_set_timer(FAST_TICK);
         } else {
+            nb_report_ms += SLOW_TICK;
             netifc_set_timer(SLOW_TICK);
         }
+        if (nb_report_ms >= REPORT_MS) {
+            nb_report_ms = 0;
+            ip6_report_drops();
+        }
+        budget = NB_LOG_BURST * NB_LOG_MAX;
+        send_log(&budget);
         if (nb_active) {
             // don't advertise if we're in a transfer
             nb_active = 0;
         } else {
-            advertise();
+            advertise(&ip6_ll_all_nodes, NB_ADVERT_PORT);
         }
     }
 
     netifc_poll();
+    send_source();
 
     if (nb_boot_now) {
         nb_boot_now = 0;
@@ -193,5 +704,24 @@ int netboot_poll(void) {
 }
 
 void netboot_close(void) {
+    size_t budget = NB_LOG_CLOSE_MAX;
+    size_t before;
+    int stalls = 0;
+
+    // send all of the log, reclaiming transmit buffers as needed,
+    // unless it is very large or the NIC stops taking packets
+    if (netifc_active()) {
+        for (;;) {
+            before = budget;
+            if (!send_log(&budget) || (budget == 0)) {
+                break;
+            }
+            stalls = (budget == before) ? (stalls + 1) : 0;
+            if (stalls == 1000) {
+                break;
+            }
+            netifc_poll();
+        }
+    }
     netifc_close();
 }
@@ -20,13 +20,55 @@
 #define NB_ADVERT_PORT 33331
 
 #define NB_COMMAND 1   // arg=0, data=command
-#define NB_SEND_FILE 2 // arg=0, data=filename
+#define NB_SEND_FILE 2 // arg=size, data=filename
 #define NB_DATA 3      // arg=blocknum, data=data
 #define NB_BOOT 4      // arg=0
+#define NB_RESUME_FILE 5 // arg=size, data=identity+filename
+                         // ack arg=bytes the device already has
+
+// Link benchmarks (nbserver --bench)
+#define NB_BENCH_SINK 6    // arg=0; until the next NB_BENCH_SINK, NB_DATA
+                           // payloads are only counted and checksummed
+#define NB_BENCH_SOURCE 7  // arg=count, data=uint32 payload size; the
+                           // device sends count NB_BENCH_DATA back
+#define NB_BENCH_DATA 8    // arg=sequence, data=nb_bench_fill() payload
+#define NB_BENCH_PING 9    // arg=any
+#define NB_BENCH_REPORT 10 // arg=0; acked with an nbbench_report
+
+#define NB_BENCH_MAX 1024 // largest NB_BENCH_DATA payload
+
+// Forward error correction (nbserver -f).  A group of up to
+// NB_FEC_MAX_K blocks, from where the device has the file up to, is
+// sent unacked along with up to NB_FEC_MAX_M parity blocks.  Parity
+// block j is the XOR of data blocks j, j + m, j + 2m..., so one block
+// lost from each of those can be rebuilt without a round trip.
+#define NB_FEC_DATA 11   // arg=offset, data=block (NB_FEC_BLOCK bytes,
+                         // bar the last block of the file)
+#define NB_FEC_PARITY 12 // arg=group offset, data=nbfec_hdr+parity block;
+                         // acked (arg=offset the device has up to) when the
+                         // group is complete, or, if the last parity block
+                         // finds it incomplete, with data=uint64 bitmap of
+                         // the blocks still missing
+
+#define NB_FEC_BLOCK 1024
+#define NB_FEC_MAX_K 64
+#define NB_FEC_MAX_M 8
+
+// Discovery, so a server need not wait for the next beacon
+#define NB_QUERY 13 // arg=0, sent to all nodes on NB_SERVER_PORT;
+                    // answered at once with an NB_ADVERTISE to the sender
+
+// A file's identity is a digest of its contents (its sha256c()),
+// so that a partial copy of another file is never resumed.
+#define NB_IDENT_LEN 32
 
 #define NB_ACK 0
 
-#define NB_ADVERTISE 0x77777777
+#define NB_ADVERTISE 0x77777777 // data="key\0value\0"... (version, serialno,
+                                // board, mac), at most NB_ADVERT_MAX bytes
+#define NB_ADVERT_MAX 256
+#define NB_IDENT_MAX 64 // longest serialno or board, with its NUL
+#define NB_LOG 0x77777778 // arg=log offset (low 32 bits), data=text
 
 #define NB_ERROR 0x80000000
 #define NB_ERROR_BAD_CMD 0x80000001
@@ -42,17 +84,86 @@ typedef struct nbmsg_t {
     uint8_t data[0];
 } nbmsg;
 
+typedef struct nbbench_report_t {
+    uint32_t packets; // NB_DATA messages sunk
+    uint32_t sum;     // total of nb_bench_sum() over their payloads
+    uint64_t bytes;
+    uint32_t sent;    // NB_BENCH_DATA messages sent
+    uint32_t busy;    // sends deferred for want of a transmit buffer
+} nbbench_report;
+
+typedef struct nbfec_hdr_t {
+    uint16_t k;     // data blocks in the group
+    uint16_t m;     // parity blocks in the group
+    uint16_t index; // which parity block this is
+    uint16_t reserved;
+    uint32_t len;   // bytes of file in the group
+} nbfec_hdr;
+
+// Position weighted, so that reordered bytes are noticed, and
+// additive, so packets may arrive in any order.
+static inline uint32_t nb_bench_sum(const uint8_t* data, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += data[i] * (uint32_t)(i + 1);
+    }
+    return sum;
+}
+
+static inline void nb_bench_fill(uint8_t* data, size_t len, uint32_t seq) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = seq * 7 + i;
+    }
+}
+
 typedef struct nbfile_t {
     uint8_t* data;
     size_t size; // max size of buffer
     size_t offset; // write pointer
+
+    // If tail is set, bytes at or past split are stored
+    // at tail + (offset - split) instead of in data.
+    uint8_t* tail;
+    size_t tail_size; // max size of tail buffer
+    size_t split;
+
+    // If nonzero, netboot_file_header() is called once
+    // this many bytes have been received.
+    size_t header;
+
+    // If set, called with each run of data once it is stored,
+    // in file order (to hash the file as it arrives, say).
+    void (*stored)(struct nbfile_t* file, const uint8_t* data, size_t len);
 } nbfile;
 
+// Describe the device in its beacons, so a server can pick what to
+// send it.  Blanks become '_'; NULL or empty strings are "unknown".
+// Call before netboot_init(), which adds the MAC address.
+void netboot_set_identity(const char* serialno, const char* board);
+
 int netboot_init(void);
 int netboot_poll(void);
 void netboot_close(void);
 
+// Forget every file received so far, and any transfer under way, so
+// that none is resumed; the next of each goes to netboot_get_buffer().
+void netboot_forget_files(void);
+
+// Stream a log to the server (or, until one is heard from, to all
+// nodes) as NB_LOG messages, a batch at a time from netboot_poll().
+// read() copies up to len bytes of log from *offset, returning how
+// many it copied, and advances *offset past anything overwritten.
+void netboot_set_log(size_t (*read)(uint64_t* offset, void* data, size_t len));
+
 // Ask for a buffer suitable to put the file /name/ in
+// /size/ is the file size announced by the server if /sized/ is set
+// (always, with NB_RESUME_FILE), so may be 0 for an empty file.
 // Return NULL to indicate /name/ is not wanted.
-nbfile* netboot_get_buffer(const char* name);
+nbfile* netboot_get_buffer(const char* name, size_t size, int sized);
 
+// Called once the first file->header bytes of a file are in
+// file->data.  The client may direct the rest of the file to
+// its final location by setting tail, tail_size, and split
+// (split may be below the number of bytes received so far).
+// Return nonzero to reject the file.
+int netboot_file_header(nbfile* file);
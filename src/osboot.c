@@ -17,8 +17,13 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <fbcon.h>
 #include <goodies.h>
+#include <mp.h>
+#include <serial.h>
 #include <netboot.h>
+#include <bootpart.h>
+#include <manifest.h>
 
 #define E820_IGNORE 0
 #define E820_RAM 1
@@ -75,10 +80,131 @@ unsigned e820type(unsigned uefi_mem_type) {
     }
 }
 
-static unsigned char scratch[32768];
-static struct e820entry e820table[128];
+// The firmware memory map and the e820 table built from it are
+// sized by prepare_memory_map(), so that nothing needs to be
+// allocated (or printed) between GetMemoryMap() and
+// ExitBootServices(), which would change the map key.
+static EFI_MEMORY_DESCRIPTOR* mmap_buf;
+static UINTN mmap_size;
+static struct e820entry* e820table;
+static unsigned e820max;
+
+// room for the map to grow between sizing and use
+#define MMAP_SLACK 16
+
+// e820 entries beyond what fits in the zero page are passed
+// in a SETUP_E820_EXT setup_data block
+#define E820_ZP_MAX 128
+#define SETUP_E820_EXT 1
+
+struct setup_data {
+    UINT64 next;
+    UINT32 type;
+    UINT32 len;
+    struct e820entry entry[];
+} __attribute__((packed));
+
+static struct setup_data* e820ext;
+
+// Sort by address.  Firmware maps are usually close to sorted,
+// which shellsort handles in about linear time.
+static void e820_sort(struct e820entry* e, unsigned n) {
+    static const unsigned gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+    struct e820entry tmp;
+    unsigned g, i, j, gap;
+
+    for (g = 0; g < (sizeof(gaps) / sizeof(gaps[0])); g++) {
+        gap = gaps[g];
+        for (i = gap; i < n; i++) {
+            tmp = e[i];
+            for (j = i; (j >= gap) && (e[j - gap].addr > tmp.addr); j -= gap) {
+                e[j] = e[j - gap];
+            }
+            e[j] = tmp;
+        }
+    }
+}
+
+// Merge adjacent or overlapping ranges of the same type.
+static unsigned e820_coalesce(struct e820entry* e, unsigned n) {
+    unsigned i, out;
+    UINT64 end;
+
+    if (n == 0) {
+        return 0;
+    }
+    for (i = 1, out = 0; i < n; i++) {
+        end = e[out].addr + e[out].size;
+        if ((e[i].type == e[out].type) && (e[i].addr <= end)) {
+            if ((e[i].addr + e[i].size) > end) {
+                e[out].size = e[i].addr + e[i].size - e[out].addr;
+            }
+            continue;
+        }
+        e[++out] = e[i];
+    }
+    return out + 1;
+}
+
+// Size and allocate the memory map buffers, with headroom for
+// the allocations themselves and anything else that happens
+// before ExitBootServices().
+int prepare_memory_map(EFI_SYSTEM_TABLE* sys) {
+    EFI_BOOT_SERVICES* bs = sys->BootServices;
+    EFI_PHYSICAL_ADDRESS mem;
+    UINTN msize = 0, mkey, dsize = 0;
+    UINT32 dversion;
+    unsigned count;
+    EFI_STATUS r;
+
+    r = bs->GetMemoryMap(&msize, NULL, &mkey, &dsize, &dversion);
+    if ((r != EFI_BUFFER_TOO_SMALL) || (dsize == 0)) {
+        printf("Cannot size memory map (%ld)\n", r);
+        return -1;
+    }
+    // each allocation below may add a descriptor or two
+    count = (msize / dsize) + MMAP_SLACK;
+    if (mmap_size >= (count * dsize)) {
+        return 0;
+    }
 
-int process_memory_map(EFI_SYSTEM_TABLE* sys, UINTN* _key, int silent) {
+    if (mmap_buf) {
+        bs->FreePool(mmap_buf);
+        bs->FreePool(e820table);
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)e820ext,
+                      EFI_SIZE_TO_PAGES(sizeof(*e820ext) + e820max * sizeof(struct e820entry)));
+        mmap_buf = NULL;
+        mmap_size = 0;
+    }
+    if (bs->AllocatePool(EfiLoaderData, count * dsize, (void**)&mmap_buf)) {
+        goto fail;
+    }
+    if (bs->AllocatePool(EfiLoaderData, count * sizeof(struct e820entry), (void**)&e820table)) {
+        bs->FreePool(mmap_buf);
+        goto fail;
+    }
+    mem = 0xFFFFFFFF;
+    if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData,
+                          EFI_SIZE_TO_PAGES(sizeof(*e820ext) + count * sizeof(struct e820entry)),
+                          &mem)) {
+        bs->FreePool(e820table);
+        bs->FreePool(mmap_buf);
+        goto fail;
+    }
+    e820ext = (void*)mem;
+    mmap_size = count * dsize;
+    e820max = count;
+    return 0;
+
+fail:
+    printf("Cannot allocate memory map (%d entries)\n", count);
+    mmap_buf = NULL;
+    return -1;
+}
+
+// Build the e820 table from the current memory map.  Must be
+// preceded by prepare_memory_map().  Neither allocates nor prints.
+int process_memory_map(EFI_SYSTEM_TABLE* sys, UINTN* _key) {
     EFI_MEMORY_DESCRIPTOR* mmap;
     struct e820entry* entry = e820table;
     UINTN msize, off;
@@ -87,42 +213,28 @@ int process_memory_map(EFI_SYSTEM_TABLE* sys, UINTN* _key, int silent) {
     unsigned n, type;
     EFI_STATUS r;
 
-    msize = sizeof(scratch);
-    mmap = (EFI_MEMORY_DESCRIPTOR*)scratch;
+    msize = mmap_size;
     mkey = dsize = dversion = 0;
-    r = sys->BootServices->GetMemoryMap(&msize, mmap, &mkey, &dsize, &dversion);
-    if (!silent)
-        printf("r=%lx msz=%lx key=%lx dsz=%lx dvn=%x\n", r, msize, mkey, dsize, dversion);
+    r = sys->BootServices->GetMemoryMap(&msize, mmap_buf, &mkey, &dsize, &dversion);
     if (r != EFI_SUCCESS) {
         return -1;
     }
-    if (msize > sizeof(scratch)) {
-        if (!silent)
-            printf("Memory Table Too Large (%ld entries)\n", (msize / dsize));
-        return -1;
-    }
     for (off = 0, n = 0; off < msize; off += dsize) {
-        mmap = (EFI_MEMORY_DESCRIPTOR*)(scratch + off);
+        mmap = (EFI_MEMORY_DESCRIPTOR*)(((UINT8*)mmap_buf) + off);
         type = e820type(mmap->Type);
         if (type == E820_IGNORE) {
             continue;
         }
-        if ((n > 0) && (entry[n - 1].type == type)) {
-            if ((entry[n - 1].addr + entry[n - 1].size) == mmap->PhysicalStart) {
-                entry[n - 1].size += mmap->NumberOfPages * 4096UL;
-                continue;
-            }
+        if (n == e820max) {
+            return -1;
         }
         entry[n].addr = mmap->PhysicalStart;
         entry[n].size = mmap->NumberOfPages * 4096UL;
         entry[n].type = type;
         n++;
-        if (n == 128) {
-            if (!silent)
-                printf("E820 Table Too Large (%ld raw entries)\n", (msize / dsize));
-            return -1;
-        }
     }
+    e820_sort(entry, n);
+    n = e820_coalesce(entry, n);
     *_key = mkey;
     return n;
 }
@@ -140,6 +252,7 @@ int process_memory_map(EFI_SYSTEM_TABLE* sys, UINTN* _key, int silent) {
 #define ZP_CMDLINE 0x228      // word (ptr)
 #define ZP_SYSSIZE 0x1F4      // word (size/16)
 #define ZP_XLOADFLAGS 0x236   // half
+#define ZP_SETUP_DATA 0x250   // dword (ptr, linked list)
 #define ZP_E820_TABLE 0x2D0   // 128 entries
 
 #define ZP_ACPI_RSD 0x080 // word phys ptr
@@ -150,23 +263,44 @@ int process_memory_map(EFI_SYSTEM_TABLE* sys, UINTN* _key, int silent) {
 #define ZP_FB_FORMAT 0x0A0
 #define ZP_FB_REGBASE 0x0A4
 #define ZP_FB_SIZE 0x0A8
+#define ZP_LOG_BASE 0x0B0 // word phys ptr to bootlog (or 0)
 
 #define ZP_MAGIC_VALUE 0xDBC64323
 
 #define ZP8(p, off) (*((UINT8*)((p) + (off))))
 #define ZP16(p, off) (*((UINT16*)((p) + (off))))
 #define ZP32(p, off) (*((UINT32*)((p) + (off))))
+#define ZP64(p, off) (*((UINT64*)((p) + (off))))
 
 typedef struct {
     UINT8* zeropage;
     UINT8* cmdline;
     void* image;
     UINT32 pages;
+    UINT32 setup_sz; // bytes preceding the image in the kernel file
+    UINT32 image_sz;
 } kernel_t;
 
+// the setup header is within the first 1K of the kernel file
+#define KERNEL_HDR_SIZE 1024
+
+// largest possible setup area ((255 + 1) sectors)
+#define KERNEL_SETUP_MAX (256 * 512)
+
 void install_memmap(kernel_t* k, struct e820entry* memmap, unsigned count) {
-    memcpy(k->zeropage + ZP_E820_TABLE, memmap, sizeof(*memmap) * count);
-    ZP8(k->zeropage, ZP_E820_COUNT) = count;
+    unsigned zpcount = (count > E820_ZP_MAX) ? E820_ZP_MAX : count;
+
+    memcpy(k->zeropage + ZP_E820_TABLE, memmap, sizeof(*memmap) * zpcount);
+    ZP8(k->zeropage, ZP_E820_COUNT) = zpcount;
+    ZP64(k->zeropage, ZP_SETUP_DATA) = 0;
+    if (count > zpcount) {
+        count -= zpcount;
+        e820ext->next = 0;
+        e820ext->type = SETUP_E820_EXT;
+        e820ext->len = sizeof(*memmap) * count;
+        memcpy(e820ext->entry, memmap + zpcount, sizeof(*memmap) * count);
+        ZP64(k->zeropage, ZP_SETUP_DATA) = (UINT64)e820ext;
+    }
 }
 
 void start_kernel(kernel_t* k) {
@@ -184,7 +318,27 @@ void start_kernel(kernel_t* k) {
         ;
 }
 
-int load_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
+void release_kernel(EFI_BOOT_SERVICES* bs, kernel_t* k) {
+    if (k->image) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->image, k->pages + 1);
+    }
+    if (k->cmdline) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->cmdline, 1);
+    }
+    if (k->zeropage) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->zeropage, 1);
+    }
+    k->zeropage = NULL;
+    k->cmdline = NULL;
+    k->image = NULL;
+    k->pages = 0;
+}
+
+// Validate the setup header found in the first KERNEL_HDR_SIZE
+// bytes of a kernel file, set up the zero page from it, and
+// allocate the kernel at its load address.  The caller places
+// the image (the file past k->setup_sz) at k->image.
+int prepare_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
     UINT32 setup_sz;
     UINT32 image_sz;
     UINT32 setup_end;
@@ -195,7 +349,7 @@ int load_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
     k->image = NULL;
     k->pages = 0;
 
-    if (sz < 1024) {
+    if (sz < KERNEL_HDR_SIZE) {
         // way too small to be a kernel
         goto fail;
     }
@@ -213,11 +367,12 @@ int load_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
     setup_end = ZP_JUMP + ZP8(image, ZP_JUMP + 1);
 
     printf("setup %d image %d  hdr %04x-%04x\n", setup_sz, image_sz, ZP_SETUP, setup_end);
-    // image size may be rounded up, thus +15
-    if ((setup_sz < 1024) || ((setup_sz + image_sz) > (sz + 15))) {
-        printf("kernel: invalid image size\n");
+    if (setup_sz < 1024) {
+        printf("kernel: invalid setup size\n");
         goto fail;
     }
+    k->setup_sz = setup_sz;
+    k->image_sz = image_sz;
 
     mem = 0xFF000;
     if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, 1, &mem)) {
@@ -237,15 +392,14 @@ int load_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
     k->pages = (image_sz + 4095) / 4096;
     if (bs->AllocatePages(AllocateAddress, EfiLoaderData, k->pages + 1, &mem)) {
         printf("kernel: cannot allocate kernel\n");
+        k->pages = 0;
         goto fail;
     }
     k->image = (void*)mem;
 
     // setup zero page, copy setup header from kernel binary
-    ZeroMem(k->zeropage, 4096);
-    CopyMem(k->zeropage + ZP_SETUP, image + ZP_SETUP, setup_end - ZP_SETUP);
-
-    CopyMem(k->image, image + setup_sz, image_sz);
+    memset(k->zeropage, 0, 4096);
+    memcpy(k->zeropage + ZP_SETUP, image + ZP_SETUP, setup_end - ZP_SETUP);
 
     // empty commandline for now
     ZP32(k->zeropage, ZP_CMDLINE) = (uint64_t)k->cmdline;
@@ -263,16 +417,7 @@ int load_kernel(EFI_BOOT_SERVICES* bs, uint8_t* image, size_t sz, kernel_t* k) {
 
     return 0;
 fail:
-    if (k->image) {
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->image, k->pages);
-    }
-    if (k->cmdline) {
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->cmdline, 1);
-    }
-    if (k->zeropage) {
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)k->zeropage, 1);
-    }
-
+    release_kernel(bs, k);
     return -1;
 }
 
@@ -323,23 +468,104 @@ uint32_t find_acpi_root(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
     return 0;
 }
 
+static EFI_GUID SmbiosTableGUID = SMBIOS_TABLE_GUID;
+static EFI_GUID Smbios3TableGUID = {
+    0xf2fd1544, 0x9794, 0x4a2c, {0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94}};
+
+// String number n of an SMBIOS structure, or NULL if it has none
+// (n is 0) or it runs past end.
+static const char* smbios_string(UINT8* p, UINT8* end, UINT8 n) {
+    const char* str = (const char*)(p + ((SMBIOS_HEADER*)p)->Length);
+
+    for (; n > 0; n--) {
+        if (((UINT8*)str >= end) || (*str == 0)) {
+            return NULL;
+        }
+        if (n == 1) {
+            return str;
+        }
+        while (((UINT8*)str < end) && *str) {
+            str++;
+        }
+        str++;
+    }
+    return NULL;
+}
+
+// Identify the machine to netboot servers from SMBIOS: by the system
+// serial number and the baseboard product name, each falling back to
+// the other structure's if missing.
+static void smbios_identify(EFI_SYSTEM_TABLE* sys) {
+    EFI_CONFIGURATION_TABLE* cfgtab = sys->ConfigurationTable;
+    const char *sys_serialno = NULL, *sys_product = NULL;
+    const char *bb_serialno = NULL, *bb_product = NULL;
+    UINT8 *p = NULL, *end = NULL;
+    int i;
+
+    for (i = 0; i < sys->NumberOfTableEntries; i++) {
+        UINT8* ep = cfgtab[i].VendorTable;
+        if (!CompareGuid(&cfgtab[i].VendorGuid, &SmbiosTableGUID) &&
+            !CompareMem(ep, "_SM_", 4)) {
+            SMBIOS_STRUCTURE_TABLE* t = (void*)ep;
+            p = (UINT8*)(uint64_t)t->TableAddress;
+            end = p + t->TableLength;
+            break;
+        }
+        if (!CompareGuid(&cfgtab[i].VendorGuid, &Smbios3TableGUID) &&
+            !CompareMem(ep, "_SM3_", 5)) {
+            // table maximum size at 0x0C, address at 0x10
+            p = (UINT8*)*(UINT64*)(ep + 0x10);
+            end = p + *(UINT32*)(ep + 0x0C);
+        }
+    }
+
+    while (p && ((p + sizeof(SMBIOS_HEADER)) <= end)) {
+        SMBIOS_HEADER* h = (void*)p;
+        if ((h->Type == 127) || (h->Length < sizeof(SMBIOS_HEADER))) {
+            break;
+        }
+        if ((h->Type == 1) && (h->Length >= 8)) {
+            sys_product = smbios_string(p, end, ((SMBIOS_TYPE1*)p)->ProductName);
+            sys_serialno = smbios_string(p, end, ((SMBIOS_TYPE1*)p)->SerialNumber);
+        } else if ((h->Type == 2) && (h->Length >= 8)) {
+            bb_product = smbios_string(p, end, ((SMBIOS_TYPE2*)p)->ProductName);
+            bb_serialno = smbios_string(p, end, ((SMBIOS_TYPE2*)p)->SerialNumber);
+        }
+        // past the strings, which end with an empty one
+        for (p += h->Length; (p + 1) < end; p++) {
+            if ((p[0] == 0) && (p[1] == 0)) {
+                break;
+            }
+        }
+        p += 2;
+    }
+    netboot_set_identity(sys_serialno ? sys_serialno : bb_serialno,
+                         bb_product ? bb_product : sys_product);
+}
+
 static EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
 
+#define BOOTLOG_SIZE (256 * 1024)
+
+// Boot a kernel set up by prepare_kernel() whose image has been
+// placed at its load address.  sz is the size of the kernel file.
 int boot_kernel(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys,
-                void* image, size_t sz, void* ramdisk, size_t rsz,
+                kernel_t* k, size_t sz, void* ramdisk, size_t rsz,
                 void* cmdline, size_t csz) {
-    kernel_t kernel;
+    kernel_t kernel = *k;
     EFI_STATUS r;
     UINTN key;
+    size_t clen;
     int n, i;
 
-    printf("boot_kernel() from %p (%ld bytes)\n", image, sz);
+    printf("boot_kernel() at %p (%ld bytes)\n", kernel.image, sz);
     if (ramdisk && rsz) {
         printf("ramdisk at %p (%ld bytes)\n", ramdisk, rsz);
     }
 
-    if (load_kernel(sys->BootServices, image, sz, &kernel)) {
-        printf("Failed to load kernel image\n");
+    // image size may be rounded up, thus +15
+    if ((kernel.setup_sz + kernel.image_sz) > (sz + 15)) {
+        printf("kernel: invalid image size\n");
         return -1;
     }
 
@@ -354,6 +580,8 @@ int boot_kernel(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys,
     ZP32(kernel.zeropage, ZP_FB_REGBASE) = 0;
     ZP32(kernel.zeropage, ZP_FB_SIZE) = 256 * 1024 * 1024;
 
+    ZP32(kernel.zeropage, ZP_LOG_BASE) = (UINT32)(uintptr_t)LogBuffer();
+
     if (cmdline) {
         // Truncate the cmdline to fit on a page
         if (csz >= 4095) {
@@ -366,17 +594,36 @@ int boot_kernel(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys,
         ZP32(kernel.zeropage, ZP_RAMDISK_BASE) = (uint32_t) (uintptr_t) ramdisk;
         ZP32(kernel.zeropage, ZP_RAMDISK_SIZE) = rsz;
     }
-    n = process_memory_map(sys, &key, 0);
-
+    // calibrate now, while Stall() is still available
+    TimeTicksPerSec();
+    TimeMark("setup");
+    TimeReport();
+
+    // size the map buffers and show what the map looks like now
+    if (prepare_memory_map(sys) ||
+        ((n = process_memory_map(sys, &key)) < 0)) {
+        printf("Cannot process memory map\n");
+        return -1;
+    }
     for (i = 0; i < n; i++) {
         struct e820entry* e = e820table + i;
         printf("%016lx %016lx %s\n", e->addr, e->size, e820name[e->type]);
     }
 
-    r = sys->BootServices->ExitBootServices(img, key);
+#if !WITH_QUIET_BOOT
+    // in quiet mode the kernel gets whatever is still in the log
+    ConsoleFlush();
+#endif
+
+    // nothing may allocate or print from here to ExitBootServices()
+    n = process_memory_map(sys, &key);
+    TimeMark("memmap");
+    r = (n < 0) ? EFI_INVALID_PARAMETER : sys->BootServices->ExitBootServices(img, key);
     if (r == EFI_INVALID_PARAMETER) {
-        n = process_memory_map(sys, &key, 1);
-        r = sys->BootServices->ExitBootServices(img, key);
+        // an event changed the map since we read it
+        TimeMark("memmap_retry");
+        n = process_memory_map(sys, &key);
+        r = (n < 0) ? EFI_INVALID_PARAMETER : sys->BootServices->ExitBootServices(img, key);
         if (r) {
             printf("Cannot ExitBootServices! (2) %ld\n", r);
             return -1;
@@ -386,111 +633,595 @@ int boot_kernel(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys,
         return -1;
     }
 
+    TimeMark("exit_boot");
+
+    // hand the boot timeline to the kernel on its commandline
+    clen = strlen((char*)kernel.cmdline);
+    if (clen && (clen < 4094)) {
+        kernel.cmdline[clen++] = ' ';
+    }
+    TimeFormat((char*)kernel.cmdline + clen, 4096 - clen);
+
     install_memmap(&kernel, e820table, n);
     start_kernel(&kernel);
 
     return 0;
 }
 
+// default sizes for servers that do not announce file sizes
 #define KBUFSIZE (32*1024*1024)
 #define RBUFSIZE (256*1024*1024)
 
 static nbfile nbkernel;
 static nbfile nbramdisk;
 static nbfile nbcmdline;
+static nbfile nbmanifest;
+
+// netbooted files are hashed as they arrive, for the manifest
+static sha256c_ctx nbkernel_hash;
+static sha256c_ctx nbramdisk_hash;
+
+static void nbfile_hash(nbfile* f, const uint8_t* data, size_t len) {
+    sha256c_update((f == &nbkernel) ? &nbkernel_hash : &nbramdisk_hash, data, len);
+}
+
+// the kernel being netbooted, or the buffer for an EFI app
+// (or for a whole kernel, if nbstaged; see netboot_file_header)
+static kernel_t nbkernel_k;
+static EFI_PHYSICAL_ADDRESS nbefi;
+static size_t nbefi_size;
+static size_t nbkernel_size;
+static int nbstaged;
+
+// The network comes up at entry, and is serviced while the boot
+// media is read, so a netboot can be under way (or done) by the
+// time the local boot succeeds or fails.  BOOT_PREFER decides
+// which wins when both have a kernel:
+#define BOOT_RACE 0  // whichever has a complete kernel first
+#define BOOT_LOCAL 1 // the boot media, whenever it has a kernel
+#define BOOT_NET 2   // the network, if a server answers in time
+#ifndef BOOT_PREFER
+#define BOOT_PREFER BOOT_RACE
+#endif
+
+// how long BOOT_NET waits for a server (or a stalled transfer)
+#define NET_GRACE_MS 3000
+
+static int nb_up;      // netboot_init() succeeded
+static int nb_racing;  // the boot media is being read
+static int nb_ready;   // a netbooted kernel or EFI app is complete
+static UINT64 nb_start;
+
+static int is_efi_app(uint8_t* x) {
+    return (x[0] == 'M') && (x[1] == 'Z') && (x[0x80] == 'P') && (x[0x81] == 'E');
+}
 
-nbfile* netboot_get_buffer(const char* name) {
-    // we know these are in a buffer large enough
-    // that this is safe (todo: implement strcmp)
-    if (!memcmp(name, "kernel.bin", 11)) {
+// Make f->data a page aligned buffer below 4GB of exactly
+// size bytes, reusing the existing buffer if it matches.
+static int nbfile_alloc(nbfile* f, size_t size) {
+    EFI_PHYSICAL_ADDRESS mem;
+
+    if (f->data) {
+        if (f->size == size) {
+            return 0;
+        }
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)f->data, EFI_SIZE_TO_PAGES(f->size));
+        f->data = NULL;
+        f->size = 0;
+    }
+    if (size == 0) {
+        // an empty file needs no buffer
+        return 0;
+    }
+    mem = 0xFFFFFFFF;
+    if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(size), &mem)) {
+        printf("netboot: cannot allocate %ld bytes\n", size);
+        return -1;
+    }
+    f->data = (void*)mem;
+    f->size = size;
+    return 0;
+}
+
+nbfile* netboot_get_buffer(const char* name, size_t size, int sized) {
+    if (!strcmp(name, "kernel.bin")) {
+        // discard any previous attempt
+        release_kernel(gBS, &nbkernel_k);
+        if (nbefi) {
+            gBS->FreePages(nbefi, EFI_SIZE_TO_PAGES(nbefi_size));
+            nbefi = 0;
+        }
+        nbstaged = 0;
+        // only the setup area is staged; the rest of the kernel
+        // is received at its load address (see netboot_file_header)
+        if (nbfile_alloc(&nbkernel, KERNEL_SETUP_MAX)) {
+            return NULL;
+        }
+        nbkernel_size = sized ? size : KBUFSIZE;
+        nbkernel.tail = NULL;
+        nbkernel.tail_size = 0;
+        nbkernel.split = 0;
+        nbkernel.header = KERNEL_HDR_SIZE;
+        nbkernel.stored = nbfile_hash;
+        sha256c_init(&nbkernel_hash);
         return &nbkernel;
     }
-    if (!memcmp(name, "ramdisk.bin", 11)) {
+    if (!strcmp(name, "ramdisk.bin")) {
+        if (nbfile_alloc(&nbramdisk, sized ? size : RBUFSIZE)) {
+            return NULL;
+        }
+        nbramdisk.stored = nbfile_hash;
+        sha256c_init(&nbramdisk_hash);
         return &nbramdisk;
     }
-    if (!memcmp(name, "cmdline", 7)) {
+    if (!strcmp(name, "cmdline")) {
         return &nbcmdline;
     }
+    if (!strcmp(name, "manifest")) {
+        return &nbmanifest;
+    }
     return NULL;
 }
 
+int netboot_file_header(nbfile* file) {
+    EFI_PHYSICAL_ADDRESS mem;
+
+    if (file != &nbkernel) {
+        return 0;
+    }
+    // while the boot media is read, its kernel may need the load
+    // address, so a netbooted one is staged whole, like an EFI
+    // app, and moved into place if it wins (see nbkernel_place)
+    nbstaged = nb_racing && !is_efi_app(file->data);
+    if (is_efi_app(file->data) || nbstaged) {
+        // EFI apps are loaded from one contiguous buffer
+        mem = 0xFFFFFFFF;
+        if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData,
+                               EFI_SIZE_TO_PAGES(nbkernel_size), &mem)) {
+            printf("Failed to allocate network io buffer\n");
+            return -1;
+        }
+        nbefi = mem;
+        nbefi_size = nbkernel_size;
+        file->tail = (void*) mem;
+        file->tail_size = nbkernel_size;
+        file->split = 0;
+        return 0;
+    }
+
+    // receive the kernel image straight into its load address
+    if (prepare_kernel(gBS, file->data, file->offset, &nbkernel_k)) {
+        return -1;
+    }
+    file->tail = nbkernel_k.image;
+    file->tail_size = (nbkernel_k.pages + 1) * 4096;
+    file->split = nbkernel_k.setup_sz;
+    return 0;
+}
+
 static char cmdline[4096];
+static char manifest[4096];
+
+// Forget the files of a netboot attempt that did not boot, so none
+// carry over into the next (nbserver sends kernel.bin last, after
+// the files that go with it).  A resend of the same files starts
+// over, through netboot_get_buffer().
+static void nbfiles_discard(void) {
+    netboot_forget_files();
+    nbkernel.offset = 0;
+    nbramdisk.offset = 0;
+    nbcmdline.offset = 0;
+    nbmanifest.offset = 0;
+    cmdline[0] = 0;
+}
+
+// Set up a kernel from its header, checking that an image of
+// sz bytes (including setup sectors) will fit at its load address.
+static int prepare_kernel_sized(uint8_t* hdr, UINTN sz, kernel_t* k) {
+    if (prepare_kernel(gBS, hdr, KERNEL_HDR_SIZE, k)) {
+        return -1;
+    }
+    if ((sz < k->setup_sz) || ((sz - k->setup_sz) > ((k->pages + 1) * 4096))) {
+        printf("kernel: invalid image size\n");
+        release_kernel(gBS, k);
+        return -1;
+    }
+    return 0;
+}
+
+// Load a kernel from the boot media, reading the image directly
+// to its load address.  If digest is not NULL, the whole file is
+// hashed into it (see manifest.h).  Returns 1 if the file does not
+// exist.
+static int load_local_kernel(CHAR16* name, kernel_t* k, UINTN* _sz, uint8_t* digest) {
+    uint8_t hdr[KERNEL_HDR_SIZE];
+    EFI_FILE_HANDLE file;
+    sha256c_ctx hash;
+    uint8_t* setup;
+    UINTN sz;
+
+    if ((file = OpenFile(name, &sz)) == NULL) {
+        return 1;
+    }
+    if ((sz < sizeof(hdr)) || ReadFile(file, hdr, sizeof(hdr))) {
+        goto fail_close;
+    }
+    if (prepare_kernel_sized(hdr, sz, k)) {
+        goto fail_close;
+    }
+    if (digest) {
+        // the setup area is never loaded, but is hashed all the same
+        if (gBS->AllocatePool(EfiLoaderData, k->setup_sz, (void**)&setup)) {
+            goto fail;
+        }
+        if (file->SetPosition(file, 0) || ReadFile(file, setup, k->setup_sz)) {
+            gBS->FreePool(setup);
+            goto fail;
+        }
+        sha256c_init(&hash);
+        sha256c_update(&hash, setup, k->setup_sz);
+        gBS->FreePool(setup);
+    }
+    if (file->SetPosition(file, k->setup_sz) ||
+        ReadFileHashed(file, k->image, sz - k->setup_sz, digest ? &hash : NULL)) {
+        goto fail;
+    }
+    if (digest) {
+        sha256c_final(&hash, digest);
+    }
+    file->Close(file);
+    *_sz = sz;
+    return 0;
+
+fail:
+    release_kernel(gBS, k);
+fail_close:
+    file->Close(file);
+    return -1;
+}
+
+// Load a kernel from the boot image partition, hashing it into
+// digest if that is not NULL.
+static int load_bootpart_kernel(kernel_t* k, UINTN* _sz, uint8_t* digest) {
+    uint8_t hdr[KERNEL_HDR_SIZE];
+    sha256c_ctx hash;
+    uint8_t* setup;
+    uint64_t sz;
+
+    if (bootpart_find("kernel.bin", &sz) || (sz < sizeof(hdr)) ||
+        bootpart_read("kernel.bin", 0, hdr, sizeof(hdr))) {
+        return -1;
+    }
+    if (prepare_kernel_sized(hdr, sz, k)) {
+        return -1;
+    }
+    if (digest) {
+        if (gBS->AllocatePool(EfiLoaderData, k->setup_sz, (void**)&setup)) {
+            goto fail;
+        }
+        if (bootpart_read("kernel.bin", 0, setup, k->setup_sz)) {
+            gBS->FreePool(setup);
+            goto fail;
+        }
+        sha256c_init(&hash);
+        sha256c_update(&hash, setup, k->setup_sz);
+        gBS->FreePool(setup);
+    }
+    if (bootpart_read("kernel.bin", k->setup_sz, k->image, sz - k->setup_sz)) {
+        goto fail;
+    }
+    if (digest) {
+        sha256c_update(&hash, k->image, sz - k->setup_sz);
+        sha256c_final(&hash, digest);
+    }
+    *_sz = sz;
+    return 0;
+
+fail:
+    release_kernel(gBS, k);
+    return -1;
+}
+
+static void free_file(void* data, UINTN sz) {
+    if (data) {
+        // LoadFile() gives empty files a page too
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)data, sz ? EFI_SIZE_TO_PAGES(sz) : 1);
+    }
+}
+
+// Release everything loaded from the boot media, so that another
+// boot source can be tried.
+static void release_loaded(kernel_t* k, void* ramdisk, UINTN rsz,
+                           void* cmdline, UINTN csz) {
+    release_kernel(gBS, k);
+    free_file(ramdisk, rsz);
+    free_file(cmdline, csz);
+}
+
+// Check loaded files against the manifest, given the kernel's
+// digest, and the ramdisk's if it was hashed while loading (if
+// not, it is hashed here, on all CPUs).  On failure everything is
+// released.
+static int verify_loaded(kernel_t* k, const uint8_t* kdigest,
+                         void* ramdisk, UINTN rsz, const uint8_t* rdigest,
+                         void* cmdline, UINTN csz) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (!manifest_active()) {
+        return 0;
+    }
+    if (ramdisk && (rdigest == NULL)) {
+        sha256c(ramdisk, rsz, digest);
+        rdigest = digest;
+    }
+    TimeMark("verify");
+    if (manifest_verify(kdigest, ramdisk ? rdigest : NULL, cmdline, csz) == 0) {
+        return 0;
+    }
+    printf("Refusing to boot unverified files\n\n");
+    release_loaded(k, ramdisk, rsz, cmdline, csz);
+    return -1;
+}
+
+static int netboot_won(void) {
+    return nb_ready && (BOOT_PREFER != BOOT_LOCAL);
+}
+
+// Service the network between reads of the boot media, abandoning
+// the read once a netboot has won.
+static int netboot_idle(void) {
+    if (!nb_up) {
+        return 0;
+    }
+    if ((netboot_poll() > 0) && (nbkernel.offset >= 32768) && nbkernel.tail) {
+        nb_ready = 1;
+    }
+    return netboot_won();
+}
+
+// With a verified kernel from the boot media in hand, decide
+// whether to boot it.  If so, the network is shut down first.
+static int choose_local(void) {
+#if BOOT_PREFER == BOOT_NET
+    // give a server time to notice us, and any transfer under way
+    // time to finish, unless it stalls
+    UINT64 wait = TimeTicksPerSec() * NET_GRACE_MS / 1000;
+    UINT64 last = nb_start;
+    size_t seen = 0;
+
+    while (nb_up && !nb_ready && ((TimeTicks() - last) < wait)) {
+        netboot_idle();
+        if (nbkernel.offset != seen) {
+            seen = nbkernel.offset;
+            last = TimeTicks();
+        }
+        LogFlush();
+        serial_kick();
+    }
+#endif
+    if (netboot_won()) {
+        printf("Netboot won; not booting from boot media\n\n");
+        return 0;
+    }
+    if (nb_up) {
+        netboot_close();
+        nb_up = 0;
+    }
+    return 1;
+}
+
+// Boot from the raw boot image partition, if there is one,
+// returning 0 to fall back to the filesystem if it is unusable.
+static int try_bootpart_boot(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
+    uint8_t kdigest[SHA256_DIGEST_SIZE];
+    UINTN ksz, rsz = 0, csz = 0, msz = 0;
+    kernel_t kernel;
+    void* manifest;
+    void* ramdisk;
+    void* cmdline;
+
+    if (bootpart_open()) {
+        return 0;
+    }
+    if ((manifest = bootpart_load("manifest", &msz)) != NULL) {
+        manifest_load(manifest, msz);
+        free_file(manifest, msz);
+    }
+    if (load_bootpart_kernel(&kernel, &ksz, manifest_active() ? kdigest : NULL)) {
+        printf("Failed to load kernel from boot image partition\n\n");
+        return 0;
+    }
+    TimeMark("kernel");
+    ramdisk = bootpart_load("ramdisk.bin", &rsz);
+    TimeMark("ramdisk");
+    cmdline = bootpart_load("cmdline", &csz);
+
+    if (verify_loaded(&kernel, kdigest, ramdisk, rsz, NULL, cmdline, csz)) {
+        return 0;
+    }
+    if (!choose_local()) {
+        release_loaded(&kernel, ramdisk, rsz, cmdline, csz);
+        return 0;
+    }
+    boot_kernel(img, sys, &kernel, ksz, ramdisk, rsz, cmdline, csz);
+    return -1;
+}
 
 int try_local_boot(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
-    UINTN ksz, rsz, csz;
-    void* kernel;
+    uint8_t kdigest[SHA256_DIGEST_SIZE];
+    uint8_t rdigest[SHA256_DIGEST_SIZE];
+    uint8_t* rhashed = NULL;
+    UINTN ksz, rsz, csz, msz;
+    sha256c_ctx rhash;
+    kernel_t kernel;
+    void* manifest;
     void* ramdisk;
     void* cmdline;
-    
-    if ((kernel = LoadFile(L"magenta.bin", &ksz)) == NULL) {
-        printf("Failed to load 'magenta.bin' from boot media\n\n");
+    int r;
+
+    // the raw partition avoids the firmware FAT driver entirely
+    if (try_bootpart_boot(img, sys) < 0) {
+        return -1;
+    }
+    if (netboot_won()) {
         return 0;
     }
-    
-    ramdisk = LoadFile(L"ramdisk.bin", &rsz);
+
+    if ((manifest = LoadFile(L"manifest", &msz)) != NULL) {
+        manifest_load(manifest, msz);
+        free_file(manifest, msz);
+    }
+    r = load_local_kernel(L"magenta.bin", &kernel, &ksz, manifest_active() ? kdigest : NULL);
+    if (r != 0) {
+        printf("Failed to load 'magenta.bin' from boot media\n\n");
+        return ((r > 0) || netboot_won()) ? 0 : -1;
+    }
+    TimeMark("kernel");
+
+    // prefer a compressed ramdisk, as reading is the slow part
+    ramdisk = LoadCompressedFile(L"ramdisk.bin.lz4", &rsz);
+    if (ramdisk == NULL) {
+        sha256c_init(&rhash);
+        ramdisk = LoadFileHashed(L"ramdisk.bin", &rsz, manifest_active() ? &rhash : NULL);
+        if (ramdisk && manifest_active()) {
+            sha256c_final(&rhash, rdigest);
+            rhashed = rdigest;
+        }
+    }
+    TimeMark("ramdisk");
     cmdline = LoadFile(L"cmdline", &csz);
 
-    boot_kernel(img, sys, kernel, ksz, ramdisk, rsz, cmdline, csz);
+    if (verify_loaded(&kernel, kdigest, ramdisk, rsz, rhashed, cmdline, csz)) {
+        return 0;
+    }
+    if (!choose_local()) {
+        release_loaded(&kernel, ramdisk, rsz, cmdline, csz);
+        return 0;
+    }
+    boot_kernel(img, sys, &kernel, ksz, ramdisk, rsz, cmdline, csz);
     return -1;
 }
 
+// Move a kernel that was staged while the boot media was read to
+// its load address, now that the local boot has given way.
+static int nbkernel_place(void) {
+    uint8_t* data = (void*) nbefi;
+
+    if (prepare_kernel_sized(data, nbkernel.offset, &nbkernel_k)) {
+        return -1;
+    }
+    mp_memcpy(nbkernel_k.image, data + nbkernel_k.setup_sz,
+              nbkernel.offset - nbkernel_k.setup_sz);
+    return 0;
+}
+
 EFI_STATUS efi_main(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
     EFI_BOOT_SERVICES* bs = sys->BootServices;
-    EFI_PHYSICAL_ADDRESS mem;
+    uint8_t kdigest[SHA256_DIGEST_SIZE];
+    uint8_t rdigest[SHA256_DIGEST_SIZE];
 
     InitializeLib(img, sys);
     InitGoodies(img, sys);
+    TimeMark("entry");
 
-    printf("\nOSBOOT v0.2\n\n");
+    // keep a log for the kernel; when quiet, the console only
+    // catches up on failure (or in the kernel)
+    LogInit(BOOTLOG_SIZE);
+#if WITH_QUIET_BOOT
+    LogSetQuiet(1);
+#endif
 
     bs->LocateProtocol(&GraphicsOutputProtocol, NULL, (void**)&gop);
-    printf("Framebuffer base is at %lx\n\n", gop->Mode->FrameBufferBase);
-
-    if (try_local_boot(img, sys) < 0) {
-        goto fail;
+    // firmware text output is slow, but may be the only console
+    // (see NOTES.txt); these replace ConOut only if built in
+#if WITH_FBCON
+    if (fbcon_init(gop) == 0) {
+        AddConsoleOutput(fbcon_write, NULL);
     }
-
-    mem = 0xFFFFFFFF;
-    if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, KBUFSIZE / 4096, &mem)) {
-        printf("Failed to allocate network io buffer\n");
-        goto fail;
+#endif
+#if WITH_SERIAL
+    if (serial_init(SERIAL_COM1, 115200) == 0) {
+        AddConsoleOutput(serial_write, serial_flush);
     }
-    nbkernel.data = (void*) mem;
-    nbkernel.size = KBUFSIZE;
+#endif
 
-    mem = 0xFFFFFFFF;
-    if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, RBUFSIZE / 4096, &mem)) {
-        printf("Failed to allocate network io buffer\n");
-        goto fail;
-    }
-    nbramdisk.data = (void*) mem;
-    nbramdisk.size = RBUFSIZE;
+    printf("\nOSBOOT v0.2\n\n");
+    printf("Framebuffer base is at %lx\n\n", gop->Mode->FrameBufferBase);
+    TimeMark("gop");
+
+    mp_init();
+    TimeMark("mp_init");
 
+    // kernel and ramdisk buffers are allocated by
+    // netboot_get_buffer() once their sizes are known
     nbcmdline.data = (void*) cmdline;
     nbcmdline.size = sizeof(cmdline);
     cmdline[0] = 0;
+    nbmanifest.data = (void*) manifest;
+    nbmanifest.size = sizeof(manifest);
+
+#if WITH_NETCONSOLE
+    // stream the log (from the start) to nbserver
+    netboot_set_log(LogRead);
+#endif
+    smbios_identify(sys);
+
+    // bring the network up before trying the boot media, as SNP
+    // start up and link negotiation can take seconds; beacons go
+    // out, and transfers run, while local files are read
+    if (netboot_init() == 0) {
+        nb_up = 1;
+        nb_start = TimeTicks();
+        printf("\nNetBoot Server Started...\n\n");
+    }
+    TimeMark("netifc");
 
-    if (netboot_init()) {
+    nb_racing = 1;
+    SetReadIdle(netboot_idle);
+    if (try_local_boot(img, sys) < 0) {
+        goto fail;
+    }
+    SetReadIdle(NULL);
+    nb_racing = 0;
+    if (!nb_up) {
         printf("Failed to initialize NetBoot\n");
         goto fail;
     }
-    printf("\nNetBoot Server Started...\n\n");
+
     for (;;) {
-        int n = netboot_poll();
+        int n = nb_ready ? 1 : netboot_poll();
+        nb_ready = 0;
         if (n < 1) {
+            // an idle point: catch the console up on quiet output,
+            // then send along some of what the UART has queued,
+            // without waiting on it while packets arrive
+            LogFlush();
+            serial_kick();
             continue;
         }
-        if (nbkernel.offset < 32768) {
+        if ((nbkernel.offset < 32768) || (nbkernel.tail == NULL)) {
             // too small to be a kernel
             continue;
         }
-        uint8_t* x = nbkernel.data;
-        if ((x[0] == 'M') && (x[1] == 'Z') && (x[0x80] == 'P') && (x[0x81] == 'E')) {
+        if (nbefi && !nbstaged) {
             UINTN exitdatasize;
             EFI_STATUS r;
             EFI_HANDLE h;
+            // an EFI app is listed in the manifest as the kernel
+            if (manifest_active()) {
+                if (nbmanifest.offset) {
+                    manifest_load(manifest, nbmanifest.offset);
+                }
+                sha256c((void*) nbefi, nbkernel.offset, kdigest);
+                if (manifest_verify(kdigest, NULL, cmdline, nbcmdline.offset)) {
+                    printf("Refusing to run unverified EFI binary\n");
+                    nbfiles_discard();
+                    continue;
+                }
+            }
             printf("Attempting to run EFI binary...\n");
-            r = bs->LoadImage(FALSE, img, NULL, (void*) nbkernel.data, nbkernel.offset, &h);
+            r = bs->LoadImage(FALSE, img, NULL, (void*) nbefi, nbkernel.offset, &h);
+            nbfiles_discard();
             if (r != EFI_SUCCESS) {
                 printf("LoadImage Failed %ld\n", r);
                 continue;
@@ -504,11 +1235,36 @@ EFI_STATUS efi_main(EFI_HANDLE img, EFI_SYSTEM_TABLE* sys) {
             continue;
         }
 
+        if (nbstaged) {
+            if (nbkernel_place()) {
+                nbfiles_discard();
+                continue;
+            }
+            gBS->FreePages(nbefi, EFI_SIZE_TO_PAGES(nbefi_size));
+            nbefi = 0;
+            nbstaged = 0;
+        }
+
         // make sure network traffic is not in flight, etc
         netboot_close();
+        TimeMark("netboot");
+
+        // a manifest sent along replaces any from the boot media
+        if (nbmanifest.offset) {
+            manifest_load(manifest, nbmanifest.offset);
+        }
+        sha256c_final(&nbkernel_hash, kdigest);
+        if (nbramdisk.offset) {
+            sha256c_final(&nbramdisk_hash, rdigest);
+        }
+        if (manifest_verify(kdigest, nbramdisk.offset ? rdigest : NULL,
+                            cmdline, nbcmdline.offset)) {
+            printf("Refusing to boot unverified files\n");
+            goto fail;
+        }
 
         // maybe it's a kernel image?
-        boot_kernel(img, sys, (void*) nbkernel.data, nbkernel.offset,
+        boot_kernel(img, sys, &nbkernel_k, nbkernel.offset,
                     (void*) nbramdisk.data, nbramdisk.offset,
                     cmdline, sizeof(cmdline));
         goto fail;
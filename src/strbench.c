@@ -0,0 +1,165 @@
+// Copyright 2016 The Fuchsia Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host benchmark for lib/string.c, which is linked in with its
+// symbols prefixed by lib_ (see the Makefile).  Checks results
+// against the C library first, then reports GB/s by size class.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void* lib_memcpy(void* dst, const void* src, size_t n);
+void* lib_memset(void* dst, int c, size_t n);
+void* lib_memmove(void* dst, const void* src, size_t n);
+int lib_memcmp(const void* a, const void* b, size_t n);
+int lib_strcmp(const char* a, const char* b);
+int lib_strncmp(const char* a, const char* b, size_t n);
+
+#define MAX_SIZE (16 * 1024 * 1024)
+#define BYTES_PER_RUN (512ULL * 1024 * 1024)
+
+static uint8_t* buf_a;
+static uint8_t* buf_b;
+static uint8_t* buf_c;
+
+static int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+static void fill(uint8_t* p, size_t n, unsigned seed) {
+    while (n-- > 0) {
+        *p++ = (seed = seed * 1103515245 + 12345) >> 16;
+    }
+}
+
+static int check(void) {
+    size_t n, i, j;
+    int errors = 0;
+
+    for (n = 0; n < 300; n++) {
+        for (i = 0; i < 16; i++) {
+            for (j = 0; j < 16; j++) {
+                fill(buf_a, 1024, n);
+                memcpy(buf_b, buf_a, 1024);
+                lib_memcpy(buf_a + i, buf_c + j, n);
+                memcpy(buf_b + i, buf_c + j, n);
+                errors += !!memcmp(buf_a, buf_b, 1024);
+
+                lib_memset(buf_a + i, j, n);
+                memset(buf_b + i, j, n);
+                errors += !!memcmp(buf_a, buf_b, 1024);
+
+                lib_memmove(buf_a + i, buf_a + j, n);
+                memmove(buf_b + i, buf_b + j, n);
+                errors += !!memcmp(buf_a, buf_b, 1024);
+
+                memcpy(buf_b, buf_a, 1024);
+                if (n) {
+                    buf_b[j + (n * 7 / 11)] ^= (i + 1);
+                }
+                errors += sign(lib_memcmp(buf_a + j, buf_b + j, n)) !=
+                          sign(memcmp(buf_a + j, buf_b + j, n));
+            }
+        }
+    }
+    errors += (lib_strcmp("kernel.bin", "kernel.bin") != 0);
+    errors += (lib_strcmp("kernel.bin", "kernel.bin.lz4") >= 0);
+    errors += (lib_strcmp("ramdisk.bin", "kernel.bin") <= 0);
+    errors += (lib_strncmp("ramdisk.bin.lz4", "ramdisk.bin", 11) != 0);
+    errors += (lib_strncmp("ramdisk.bin.lz4", "ramdisk.bin", 12) <= 0);
+    return errors;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum { OP_MEMCPY, OP_MEMCPY_UNALIGNED, OP_MEMSET, OP_MEMMOVE, OP_MEMCMP, OP_COUNT };
+
+static const char* opname[OP_COUNT] = {
+    "memcpy", "memcpy+3", "memset", "memmove", "memcmp",
+};
+
+static volatile int sink;
+
+static double run(int op, int lib, size_t n) {
+    size_t reps = BYTES_PER_RUN / n;
+    double t;
+    size_t i;
+
+    if (reps > 10000000) {
+        reps = 10000000;
+    }
+    t = now();
+    for (i = 0; i < reps; i++) {
+        switch (op) {
+        case OP_MEMCPY:
+            lib ? lib_memcpy(buf_a, buf_b, n) : memcpy(buf_a, buf_b, n);
+            break;
+        case OP_MEMCPY_UNALIGNED:
+            lib ? lib_memcpy(buf_a + 3, buf_b + 1, n) : memcpy(buf_a + 3, buf_b + 1, n);
+            break;
+        case OP_MEMSET:
+            lib ? lib_memset(buf_a, i, n) : memset(buf_a, i, n);
+            break;
+        case OP_MEMMOVE:
+            lib ? lib_memmove(buf_a + 8, buf_a, n) : memmove(buf_a + 8, buf_a, n);
+            break;
+        case OP_MEMCMP:
+            sink += lib ? lib_memcmp(buf_b, buf_c, n) : memcmp(buf_b, buf_c, n);
+            break;
+        }
+        __asm__ volatile("" ::: "memory");
+    }
+    t = now() - t;
+    return (reps * (double)n) / t / 1e9;
+}
+
+int main(int argc, char** argv) {
+    static const size_t sizes[] = {
+        8, 32, 128, 512, 2048, 8192, 65536, 1024 * 1024, MAX_SIZE,
+    };
+    int errors, op;
+    unsigned i;
+
+    buf_a = aligned_alloc(4096, MAX_SIZE + 4096);
+    buf_b = aligned_alloc(4096, MAX_SIZE + 4096);
+    buf_c = aligned_alloc(4096, MAX_SIZE + 4096);
+    if (!buf_a || !buf_b || !buf_c) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    fill(buf_c, MAX_SIZE + 4096, 1);
+
+    if ((errors = check()) != 0) {
+        fprintf(stderr, "%s: %d mismatches against the C library\n", argv[0], errors);
+        return 1;
+    }
+    printf("results match the C library\n\n");
+
+    memcpy(buf_b, buf_c, MAX_SIZE);
+    printf("%-10s %10s %10s %10s\n", "op", "size", "lib GB/s", "libc GB/s");
+    for (op = 0; op < OP_COUNT; op++) {
+        for (i = 0; i < (sizeof(sizes) / sizeof(sizes[0])); i++) {
+            printf("%-10s %10zu %10.2f %10.2f\n", opname[op], sizes[i],
+                   run(op, 1, sizes[i]), run(op, 0, sizes[i]));
+        }
+    }
+    return 0;
+}